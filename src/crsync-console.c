@@ -65,11 +65,11 @@ static void showUsage() {
 
 static void showUsage_digest() {
     printf( "digest Usage:\n"
-            "crsync digest srcFilename dstFilename blockSize\n");
+            "crsync digest srcFilename dstFilename blockSize [tree] [fineDivisor]\n");
 }
 
 int main_digest(int argc, char **argv) {
-    if(argc != 5) {
+    if(argc < 5 || argc > 7) {
         showUsage_digest();
         return -1;
     }
@@ -79,6 +79,14 @@ int main_digest(int argc, char **argv) {
     const char *srcFilename = argv[c++];
     const char *dstFilename = argv[c++];
     uint32_t blockSize = atoi(argv[c++]) * 1024;
+    while(c < argc) {
+        const char *opt = argv[c++];
+        if(0 == strcmp(opt, "tree")) {
+            Digest_setMode(DIGEST_MODE_TREE);
+        } else {
+            Merkle_setFineDivisor(atoi(opt));
+        }
+    }
 
     CRScode code = crs_perform_digest(srcFilename, dstFilename, blockSize);
     return code;
@@ -145,6 +153,8 @@ int main_bulkDigest(int argc, char **argv) {
         if(!nextVersion) break;
         unsigned int blockSize = iniparser_getint(dic, "global:blockSize", 16);
         blockSize *= 1024;
+        Digest_setMode(iniparser_getint(dic, "global:digestMode", DIGEST_MODE_FILE));
+        Merkle_setFineDivisor(iniparser_getint(dic, "global:fineDivisor", 0));
 
         cleanDir(outputDir);
         m->currVersion = strdup(currVersion);
@@ -162,7 +172,6 @@ int main_bulkDigest(int argc, char **argv) {
             free(dstFilename);
             free(digestFilename);
 
-            sum_t *sum = sum_malloc();
             const char *secname = iniparser_getsecname(dic, i);
 
             char *dirKey = Util_strcat(secname, ":dir");
@@ -173,22 +182,16 @@ int main_bulkDigest(int argc, char **argv) {
             const char *nameValue = iniparser_getstring(dic, nameKey, NULL);
             free(nameKey);
 
-            sum->name = strdup(nameValue);
-
             srcFilename = Util_strcat(dirValue, nameValue);
             struct stat st;
-            if(stat(srcFilename, &st) == 0) {
-                sum->size = st.st_size;
-            } else {
+            if(stat(srcFilename, &st) != 0) {
                 LOGE("stat error %s\n", srcFilename);
-                sum_free(sum);
                 result = -1;
                 break;
             }
 
             Digest_CalcStrong_File(srcFilename, hash);
-            memcpy(sum->digest, hash, CRS_STRONG_DIGEST_SIZE);
-            LL_APPEND(m->file, sum);
+            magnet_add(m, nameValue, st.st_size, hash);
 
             hashString = Util_hex_string(hash, CRS_STRONG_DIGEST_SIZE);
             dstFilename = Util_strcat(outputDir, hashString);
@@ -208,9 +211,10 @@ int main_bulkDigest(int argc, char **argv) {
         free(dstFilename);
         free(digestFilename);
 
+        magnet_finish(m);
         char magnetFilename[512];
         snprintf(magnetFilename, 512, "%s%s%s", outputDir, currVersion, MAGNET_EXT);
-        magnet_save(m, magnetFilename);
+        magnet_saveTpl(m, magnetFilename); //published, deployed clients read tpl only
 
         UT_string *str = NULL;
         utstring_new(str);
@@ -276,11 +280,12 @@ int main_patch(int argc, char **argv) {
 
 static void showUsage_update() {
     printf( "update Usage:\n"
-            "crsync update srcFilename dstFilename digestUrl url\n");
+            "crsync update srcFilename dstFilename digestUrl url [baseUrl mirrorUrl]...\n"
+            "  urls under baseUrl also fetched from same path under mirrorUrl\n");
 }
 
 int main_update(int argc, char **argv) {
-    if(argc != 6) {
+    if(argc < 6 || (argc - 6) % 2 != 0) {
         showUsage_update();
         return -1;
     }
@@ -297,6 +302,10 @@ int main_update(int argc, char **argv) {
         LOGE("end %d\n", CRS_INIT_ERROR);
         return CRS_INIT_ERROR;
     }
+    while(c + 1 < argc) {
+        HTTP_mirrorAdd(argv[c], argv[c+1]);
+        c += 2;
+    }
 
     code = crs_perform_update(srcFilename, dstFilename, digestUrl, url);
 
@@ -393,12 +402,8 @@ int main_bulkHelper(int argc, char **argv) {
         return CRS_INIT_ERROR;
     }
 
-    code = bulkHelper_perform_diff(bh);
-
-    //TODO: check here logic right ?
-    if(code == CRS_OK) {
-        code = bulkHelper_perform_patch(bh);
-    }
+    //diff and patch overlapped
+    code = bulkHelper_perform_update(bh);
 
     bulkHelper_free(bh);
 
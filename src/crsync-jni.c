@@ -50,6 +50,20 @@ static time_t      gTime = 0;
 
 static bulkHelper_t *gBulkHelper = NULL;
 
+//callbacks may come from bulk pipeline threads, attach them once
+static JNIEnv* JNI_env() {
+    JNIEnv *env = NULL;
+    jint r = (*gJavaVM)->GetEnv(gJavaVM, (void**)&env, JNI_VERSION_1_6);
+    if(r == JNI_EDETACHED) {
+        if((*gJavaVM)->AttachCurrentThreadAsDaemon(gJavaVM, &env, NULL) != JNI_OK) {
+            env = NULL;
+        }
+    } else if(r != JNI_OK) {
+        env = NULL;
+    }
+    return env;
+}
+
 int crs_callback_patch(const char *basename, const unsigned int bytes, const int isComplete, const int immediate) {
     time_t nowTime;
     time(&nowTime);
@@ -59,9 +73,9 @@ int crs_callback_patch(const char *basename, const unsigned int bytes, const int
     }
     gTime = nowTime;
 
-    JNIEnv *env = NULL;
+    JNIEnv *env = JNI_env();
     int isCancel = 0;
-    if ((*gJavaVM)->GetEnv(gJavaVM, (void**)&env, JNI_VERSION_1_6) == JNI_OK) {
+    if (env) {
         jstring jname = (*env)->NewStringUTF( env, basename );
         isCancel = (*env)->CallStaticIntMethod(env, gJavaClass, gMethod_onProgress, jname, (jlong)bytes, (jint)isComplete);
         (*env)->DeleteLocalRef(env, jname);
@@ -70,8 +84,8 @@ int crs_callback_patch(const char *basename, const unsigned int bytes, const int
 }
 
 void crs_callback_diff(const char *basename, const unsigned int bytes, const int isComplete) {
-    JNIEnv *env = NULL;
-    if ((*gJavaVM)->GetEnv(gJavaVM, (void**)&env, JNI_VERSION_1_6) == JNI_OK) {
+    JNIEnv *env = JNI_env();
+    if (env) {
         jstring jname = (*env)->NewStringUTF( env, basename );
         (*env)->CallStaticVoidMethod(env, gJavaClass, gMethod_onDiff, jname, (jlong)bytes, (jint)isComplete);
         (*env)->DeleteLocalRef(env, jname);
@@ -109,9 +123,9 @@ jstring JNI_crsync_get_magnet(JNIEnv *env, jclass clazz) {
 
     magnet_t *m = gBulkHelper->currentMagnet;
     if(m) {
-        sum_t *elt=NULL;
-        LL_FOREACH(m->file, elt) {
-            utstring_printf(result, "%s;", elt->name);
+        for(uint32_t i=0; i<m->fileNum; ++i) {
+            const sum_t *elt = &m->file[i];
+            utstring_printf(result, "%s;", magnet_name(m, elt));
             char * hashStr = Util_hex_string(elt->digest, CRS_STRONG_DIGEST_SIZE);
             utstring_printf(result, "%s;", hashStr);
             free(hashStr);
@@ -52,6 +52,24 @@ CRScode crs_perform_digest(const char *srcFilename, const char *dstFilename, con
         code = Digest_Perform(srcFilename, blockSize, fd);
         if(code != CRS_OK) break;
         code = Digest_Save(dstFilename, fd);
+        if(code != CRS_OK) break;
+        //range addressable copy, clients holding old digest fetch changed parts only
+        char *treeFilename = Util_strcat(dstFilename, MERKLE_EXT);
+        code = Merkle_Save(treeFilename, fd);
+        free(treeFilename);
+        if(code != CRS_OK) break;
+        //smaller blocks, clients fetch parts under their missing blocks only
+        uint32_t divisor = Merkle_getFineDivisor();
+        if(divisor > 1 && blockSize % divisor == 0) {
+            fileDigest_t *fine = fileDigest_malloc();
+            code = Digest_Perform(srcFilename, blockSize / divisor, fine);
+            if(code == CRS_OK) {
+                char *fineFilename = Util_strcat(dstFilename, MERKLE_FINE_EXT);
+                code = Merkle_Save(fineFilename, fine);
+                free(fineFilename);
+            }
+            fileDigest_free(fine);
+        }
     } while(0);
 
     fileDigest_free(fd);
@@ -60,6 +78,67 @@ CRScode crs_perform_digest(const char *srcFilename, const char *dstFilename, con
     return code;
 }
 
+//fetch digest by merkle tree against src-File's local digest, mostly for small changes
+static CRScode crs_perform_merkle(const char *srcFilename, const char *digestUrl, fileDigest_t *out) {
+    LOGI("begin\n");
+    CRScode code = CRS_OK;
+    char *localFilename = Util_strcat(srcFilename, DIGEST_EXT);
+    char *treeUrl = Util_strcat(digestUrl, MERKLE_EXT);
+    fileDigest_t *old = fileDigest_malloc();
+    fileDigest_t *fd = fileDigest_malloc();
+    do {
+        if(0 != Digest_checkfile(localFilename)) {
+            code = CRS_FILE_ERROR;
+            break;
+        }
+        code = Digest_Load(localFilename, old);
+        if(code != CRS_OK) break;
+        code = Merkle_Fetch(treeUrl, old, fd);
+        if(code != CRS_OK) break;
+        //out untouched unless fetched
+        fileDigest_t t = *out;
+        *out = *fd;
+        *fd = t;
+    } while(0);
+    fileDigest_free(old);
+    fileDigest_free(fd);
+    free(treeUrl);
+    free(localFilename);
+    LOGI("end %d\n", code);
+    return code;
+}
+
+//diff missing blocks again with fine digest, kept in dr to patch by if less missing,
+//fd stays the coarse one, saved as .sum and checking the patched file
+static void crs_perform_refine(const char *srcFilename, const char *dstFilename, const char *digestUrl,
+                               fileDigest_t *fd, diffResult_t *dr) {
+    LOGI("begin\n");
+    char *fineUrl = Util_strcat(digestUrl, MERKLE_FINE_EXT);
+    fileDigest_t *fine = fileDigest_malloc();
+    diffResult_t *fineDr = diffResult_malloc();
+    CRScode code = Merkle_FetchMissing(fineUrl, fd, dr, fine);
+    if(code == CRS_OK) {
+        code = Diff_refine(srcFilename, dstFilename, fd, dr, fine, fineDr);
+    }
+    if(code == CRS_OK) {
+        size_t missBytes = (size_t)(dr->totalNum - dr->matchNum - dr->cacheNum) * fd->blockSize;
+        size_t fineMissBytes = (size_t)(fineDr->totalNum - fineDr->matchNum - fineDr->cacheNum) * fine->blockSize;
+        LOGI("missing %luBytes, refined %luBytes\n", (unsigned long)missBytes, (unsigned long)fineMissBytes);
+        if(fineMissBytes < missBytes) {
+            fileDigest_free(dr->fine);
+            diffResult_free(dr->fineDr);
+            dr->fine = fine;
+            dr->fineDr = fineDr;
+            fine = NULL;
+            fineDr = NULL;
+        }
+    }
+    fileDigest_free(fine);
+    diffResult_free(fineDr);
+    free(fineUrl);
+    LOGI("end %d\n", code);
+}
+
 CRScode crs_perform_diff(const char *srcFilename, const char *dstFilename, const char *digestUrl,
                          fileDigest_t *fd, diffResult_t *dr) {
     LOGI("begin\n");
@@ -74,14 +153,22 @@ CRScode crs_perform_diff(const char *srcFilename, const char *dstFilename, const
     LOGI("digestFilename = %s\n", digestFilename);
 
     do {
-        if(0 != Digest_checkfile(digestFilename)) {
-            code = HTTP_File(digestUrl, digestFilename, 1, NULL);
+        //digest kept in memory, dst's .sum is saved by crs_perform_patch once dst done
+        if(0 == Digest_checkfile(digestFilename)) {
+            code = Digest_Load(digestFilename, fd);
+        } else if(CRS_OK != crs_perform_merkle(srcFilename, digestUrl, fd)) {
+            uint8_t *data = NULL;
+            size_t size = 0;
+            code = HTTP_Memory(digestUrl, NULL, 1, &data, &size);
             if(code != CRS_OK) break;
+            code = Digest_LoadMemory(data, size, fd);
+            free(data);
         }
-
-        code = Digest_Load(digestFilename, fd);
         if(code != CRS_OK) break;
         code = Diff_perform(srcFilename, dstFilename, fd, dr);
+        if(code == CRS_OK && Merkle_getFineDivisor() > 1 && dr->totalNum > dr->matchNum + dr->cacheNum) {
+            crs_perform_refine(srcFilename, dstFilename, digestUrl, fd, dr);
+        }
     } while(0);
 
     free(digestFilename);
@@ -93,9 +180,36 @@ CRScode crs_perform_diff(const char *srcFilename, const char *dstFilename, const
 
 CRScode crs_perform_patch(const char *srcFilename, const char *dstFilename, const char *url,
                           const fileDigest_t *fd, const diffResult_t *dr) {
+    return crs_perform_borrow(srcFilename, dstFilename, url, fd, dr, NULL, 0);
+}
+
+CRScode crs_perform_borrow(const char *srcFilename, const char *dstFilename, const char *url,
+                           const fileDigest_t *fd, const diffResult_t *dr,
+                           const patchBorrow_t *borrow, uint32_t borrowNum) {
     LOGI("begin\n");
     CRScode code = CRS_OK;
-    code = Patch_perform(srcFilename, dstFilename, url, fd, dr);
+    code = Patch_performBorrow(srcFilename, dstFilename, url, fd, dr, borrow, borrowNum);
+    if(code == CRS_OK) {
+        //dst-File's own digest, newer than dst-File, used by next Diff_perform as local digest
+        char *digestFilename = Util_strcat(dstFilename, DIGEST_EXT);
+        Digest_Save(digestFilename, fd);
+        free(digestFilename);
+    }
+    LOGI("end %d\n", code);
+    return code;
+}
+
+CRScode crs_perform_inplace(const char *srcFilename, const char *url,
+                            const fileDigest_t *fd, const diffResult_t *dr) {
+    LOGI("begin\n");
+    CRScode code = CRS_OK;
+    code = Patch_inplace(srcFilename, url, fd, dr);
+    if(code == CRS_OK) {
+        //src-File is target now, keep its digest as local digest
+        char *digestFilename = Util_strcat(srcFilename, DIGEST_EXT);
+        Digest_Save(digestFilename, fd);
+        free(digestFilename);
+    }
     LOGI("end %d\n", code);
     return code;
 }
@@ -33,6 +33,7 @@ extern "C" {
 #include "digest.h"
 #include "diff.h"
 #include "patch.h"
+#include "merkle.h"
 #include "uthash.h"
 #include "utlist.h"
 #include "utstring.h"
@@ -47,6 +48,15 @@ CRScode crs_perform_diff    (const char *srcFilename, const char *dstFilename, c
 CRScode crs_perform_patch   (const char *srcFilename, const char *dstFilename, const char *url,
                             const fileDigest_t *fd, const diffResult_t *dr);
 
+//crs_perform_patch, some missing blocks copied from other local files
+CRScode crs_perform_borrow  (const char *srcFilename, const char *dstFilename, const char *url,
+                            const fileDigest_t *fd, const diffResult_t *dr,
+                            const patchBorrow_t *borrow, uint32_t borrowNum);
+
+//patch srcFilename itself, without dst file
+CRScode crs_perform_inplace (const char *srcFilename, const char *url,
+                            const fileDigest_t *fd, const diffResult_t *dr);
+
 CRScode crs_perform_update  (const char *srcFilename, const char *dstFilename, const char *digestUrl, const char *url);
 
 #if defined __cplusplus
@@ -8,6 +8,7 @@ DESTDIR = m32
 
 SOURCES += \
     digest.c \
+    merkle.c \
     diff.c \
     patch.c \
     http.c \
@@ -26,6 +27,7 @@ SOURCES += \
 HEADERS += \
     global.h \
     digest.h \
+    merkle.h \
     diff.h \
     patch.h \
     http.h \
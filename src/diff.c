@@ -28,6 +28,7 @@ SOFTWARE.
 #include "unistd-cross.h"
 #include "diff.h"
 #include "uthash.h"
+#include "util.h"
 #include "log.h"
 
 typedef struct diffHash_t {
@@ -63,6 +64,8 @@ diffResult_t* diffResult_malloc() {
 void diffResult_free(diffResult_t *dr) {
     if(dr) {
         free(dr->offsets);
+        fileDigest_free(dr->fine);
+        diffResult_free(dr->fineDr);
         free(dr);
     }
 }
@@ -78,12 +81,14 @@ void diffResult_dump(const diffResult_t *dr) {
     }
 }
 
-static diffHash_t* Diff_hash(const fileDigest_t *fd) {
+//hash of all blocks, or only blocks still missing in dr if dr not NULL
+static diffHash_t* Diff_hash(const fileDigest_t *fd, const diffResult_t *dr) {
     diffHash_t *dh = NULL;
     diffHash_t *item = NULL, *temp = NULL;
     uint32_t blockNum = fd->fileSize / fd->blockSize;
 
     for(size_t i=0; i<blockNum; ++i) {
+        if(dr && dr->offsets[i] != -1) continue;
 
         item = diffHash_malloc();
         item->weak = fd->blockDigest[i].weak;
@@ -103,23 +108,117 @@ static diffHash_t* Diff_hash(const fileDigest_t *fd) {
 
 #define DIFF_PARALLELISM_DEGREE 4
 
-static void Diff_match(const char *filename, const fileDigest_t *fd, const diffHash_t **dh, diffResult_t *dr) {
-    dr->totalNum = fd->fileSize / fd->blockSize;
-    dr->matchNum = 0;
-    dr->cacheNum = 0;
-    dr->offsets = malloc(dr->totalNum * sizeof(int32_t));
-    memset(dr->offsets, -1, dr->totalNum * sizeof(int32_t));
+//rolling scan windows which start in [read_begin, read_end - blockSize]
+static void Diff_scan(FILE *file, const fileDigest_t *fd, const diffHash_t **dh, diffResult_t *dr,
+                      size_t read_begin, size_t read_end) {
+    size_t read_len = read_end - read_begin;
+    size_t offset = read_begin;
 
+    unsigned char *buf1 = malloc(fd->blockSize);
+    unsigned char *buf2 = malloc(fd->blockSize);
+
+    size_t r;
+
+    r = fseek(file, read_begin, SEEK_SET);
+    if(r != 0) {
+        LOGE("error fseek\n");
+    }
+    r = fread(buf1, 1, fd->blockSize, file);
+    read_len -= fd->blockSize;
+    if(r != fd->blockSize) {
+        LOGE("error fread\n");
+    }
+    uint32_t weak;
+    uint8_t strong[CRS_STRONG_DIGEST_SIZE];
+    diffHash_t *sumItem = NULL, *sumIter = NULL, *sumTemp = NULL;
+
+    //Digest_match_first
+    Digest_CalcWeak_Data(buf1, fd->blockSize, &weak);
+    HASH_FIND_INT( *dh, &weak, sumItem );
+    if(sumItem) {
+        Digest_CalcStrong_Data(buf1, fd->blockSize, strong);
+        if (0 == memcmp(strong, sumItem->strong, CRS_STRONG_DIGEST_SIZE)) {
+            dr->offsets[sumItem->seq] = offset;
+        }
+        HASH_ITER(hh, sumItem->sub, sumIter, sumTemp) {
+            if (0 == memcmp(strong, sumIter->strong, CRS_STRONG_DIGEST_SIZE)) {
+                dr->offsets[sumIter->seq] = offset;
+            }
+        }
+    }
+
+    //Digest_match_loop
+    while(read_len >= fd->blockSize) {
+        r = fread(buf2, 1, fd->blockSize, file);
+        if(r != fd->blockSize) {
+            LOGE("error fread\n");
+        }
+        read_len -= fd->blockSize;
+
+        for(size_t i=0; i<fd->blockSize;) {
+            Digest_CalcWeak_Roll(buf1[i], buf2[i], fd->blockSize, &weak);
+            ++i;
+            ++offset;
+            HASH_FIND_INT( *dh, &weak, sumItem );
+            if(sumItem) {
+                Digest_CalcStrong_Data2(buf1, buf2, fd->blockSize, i, strong);
+                if (0 == memcmp(strong, sumItem->strong, CRS_STRONG_DIGEST_SIZE)) {
+                    dr->offsets[sumItem->seq] = offset;
+                }
+                HASH_ITER(hh, sumItem->sub, sumIter, sumTemp) {
+                    if (0 == memcmp(strong, sumIter->strong, CRS_STRONG_DIGEST_SIZE)) {
+                        dr->offsets[sumIter->seq] = offset;
+                    }
+                }
+            }
+        }
+        //switch buffer
+        uint8_t *tmpbuf = buf1;
+        buf1 = buf2;
+        buf2 = tmpbuf;
+    }
+
+    //Digest_match_end
+    if(read_len > 0) {
+        r = fread(buf2, 1, read_len, file);
+        if(r != read_len) {
+            LOGE("error fread\n");
+        }
+        for(size_t i=0; i<read_len;) {
+            Digest_CalcWeak_Roll(buf1[i], buf2[i], fd->blockSize, &weak);
+            ++i;
+            ++offset;
+            HASH_FIND_INT( *dh, &weak, sumItem );
+            if(sumItem) {
+                Digest_CalcStrong_Data2(buf1, buf2, fd->blockSize, i, strong);
+                if (0 == memcmp(strong, sumItem->strong, CRS_STRONG_DIGEST_SIZE)) {
+                    dr->offsets[sumItem->seq] = offset;
+                }
+                HASH_ITER(hh, sumItem->sub, sumIter, sumTemp) {
+                    if (0 == memcmp(strong, sumIter->strong, CRS_STRONG_DIGEST_SIZE)) {
+                        dr->offsets[sumIter->seq] = offset;
+                    }
+                }
+            }
+        }
+    }
+
+    free(buf1);
+    free(buf2);
+}
+
+static void Diff_match(const char *filename, const fileDigest_t *fd, const diffHash_t **dh, diffResult_t *dr) {
     struct stat st;
     if(stat(filename, &st)!=0 || (size_t)st.st_size <= fd->blockSize*DIFF_PARALLELISM_DEGREE) {
         // file not exist || small file
         return;
     }
 
-    const size_t parallel_size = (st.st_size + DIFF_PARALLELISM_DEGREE - 1) / DIFF_PARALLELISM_DEGREE;
-
 #pragma omp parallel shared(fd, dh, dr), num_threads(DIFF_PARALLELISM_DEGREE)
     {
+        //nested in bulk pipeline threads, team may be smaller than asked
+        size_t degree = omp_get_num_threads();
+        size_t parallel_size = (st.st_size + degree - 1) / degree;
         size_t id__ = omp_get_thread_num();
         FILE *file = fopen(filename, "rb");
         if(file)
@@ -128,117 +227,143 @@ static void Diff_match(const char *filename, const fileDigest_t *fd, const diffH
             size_t read_end = 0;
             if(id__ == 0) {
                 read_begin = 0;
-                read_end = parallel_size;
-            } else if(id__ == DIFF_PARALLELISM_DEGREE-1) {
+                read_end = (degree == 1) ? (size_t)st.st_size : parallel_size;
+            } else if(id__ == degree-1) {
                 read_begin = id__ * parallel_size - fd->blockSize + 1;
                 read_end = st.st_size;
             } else {
                 read_begin = id__ * parallel_size - fd->blockSize + 1;
                 read_end = (id__+1) * parallel_size;
             }
-            size_t read_len = read_end - read_begin;
-            size_t offset = read_begin;
+            Diff_scan(file, fd, dh, dr, read_begin, read_end);
+            fclose(file);
+        }//end of if(file)
+    }//end of omp parallel (DIFF_PARALLELISM_DEGREE)
+}
 
-            unsigned char *buf1 = malloc(fd->blockSize);
-            unsigned char *buf2 = malloc(fd->blockSize);
+static long Diff_mtimeNsec(const struct stat *st) {
+#if defined(_MSC_VER)
+    (void)st;
+    return 0;
+#elif defined(__APPLE__)
+    return st->st_mtimespec.tv_nsec;
+#else
+    return st->st_mtim.tv_nsec;
+#endif
+}
 
-            size_t r;
+//source file's own digest, valid only if saved strictly after the last source modification;
+//same timestamp may hide a rewrite after the digest. matched blocks are not read here, an mtime
+//restoring rewrite slips through, so patch checks each one's strong digest as copied
+static fileDigest_t* Diff_localDigest(const char *filename, const fileDigest_t *fd) {
+    fileDigest_t *local = NULL;
+    char *digestFilename = Util_strcat(filename, DIGEST_EXT);
+    struct stat st;
+    struct stat stDigest;
+    if(stat(filename, &st) == 0 && stat(digestFilename, &stDigest) == 0 &&
+       (stDigest.st_mtime > st.st_mtime ||
+        (stDigest.st_mtime == st.st_mtime && Diff_mtimeNsec(&stDigest) > Diff_mtimeNsec(&st)))) {
+        local = fileDigest_malloc();
+        if(CRS_OK != Digest_Load(digestFilename, local) ||
+           local->fileSize != (size_t)st.st_size || local->blockSize != fd->blockSize) {
+            LOGI("local digest outdated\n");
+            fileDigest_free(local);
+            local = NULL;
+        }
+    }
+    free(digestFilename);
+    return local;
+}
 
-            r = fseek(file, read_begin, SEEK_SET);
-            if(r != 0) {
-                LOGE("error fseek\n");
-            }
-            r = fread(buf1, 1, fd->blockSize, file);
-            read_len -= fd->blockSize;
-            if(r != fd->blockSize) {
-                LOGE("error fread\n");
-            }
-            uint32_t weak;
-            uint8_t strong[CRS_STRONG_DIGEST_SIZE];
-            diffHash_t *sumItem = NULL, *sumIter = NULL, *sumTemp = NULL;
+typedef struct diffGap_t {
+    size_t begin;
+    size_t end;
+} diffGap_t;
 
-            //Digest_match_first
-            Digest_CalcWeak_Data(buf1, fd->blockSize, &weak);
-            HASH_FIND_INT( *dh, &weak, sumItem );
-            if(sumItem) {
-                Digest_CalcStrong_Data(buf1, fd->blockSize, strong);
-                if (0 == memcmp(strong, sumItem->strong, CRS_STRONG_DIGEST_SIZE)) {
-                    dr->offsets[sumItem->seq] = offset;
-                }
-                HASH_ITER(hh, sumItem->sub, sumIter, sumTemp) {
-                    if (0 == memcmp(strong, sumIter->strong, CRS_STRONG_DIGEST_SIZE)) {
-                        dr->offsets[sumIter->seq] = offset;
-                    }
-                }
-            }
+static int diffGap_cmp(const void *a, const void *b) {
+    const diffGap_t *x = a, *y = b;
+    return (x->begin < y->begin) ? -1 : (x->begin > y->begin);
+}
 
-            //Digest_match_loop
-            while(read_len >= fd->blockSize) {
-                r = fread(buf2, 1, fd->blockSize, file);
-                if(r != fd->blockSize) {
-                    LOGE("error fread\n");
-                }
-                read_len -= fd->blockSize;
-
-                for(size_t i=0; i<fd->blockSize;) {
-                    Digest_CalcWeak_Roll(buf1[i], buf2[i], fd->blockSize, &weak);
-                    ++i;
-                    ++offset;
-                    HASH_FIND_INT( *dh, &weak, sumItem );
-                    if(sumItem) {
-                        Digest_CalcStrong_Data2(buf1, buf2, fd->blockSize, i, strong);
-                        if (0 == memcmp(strong, sumItem->strong, CRS_STRONG_DIGEST_SIZE)) {
-                            dr->offsets[sumItem->seq] = offset;
-                        }
-                        HASH_ITER(hh, sumItem->sub, sumIter, sumTemp) {
-                            if (0 == memcmp(strong, sumIter->strong, CRS_STRONG_DIGEST_SIZE)) {
-                                dr->offsets[sumIter->seq] = offset;
-                            }
-                        }
-                    }
-                }
-                //switch buffer
-                uint8_t *tmpbuf = buf1;
-                buf1 = buf2;
-                buf2 = tmpbuf;
-            }
+//match aligned source blocks by digest, then rolling scan only around unmatched source blocks
+static int Diff_local(const char *filename, const fileDigest_t *fd, const diffHash_t **dh, diffResult_t *dr) {
+    fileDigest_t *local = Diff_localDigest(filename, fd);
+    if(!local) {
+        return -1;
+    }
 
-            //Digest_match_end
-            if(read_len > 0) {
-                r = fread(buf2, 1, read_len, file);
-                if(r != read_len) {
-                    LOGE("error fread\n");
-                }
-                for(size_t i=0; i<read_len;) {
-                    Digest_CalcWeak_Roll(buf1[i], buf2[i], fd->blockSize, &weak);
-                    ++i;
-                    ++offset;
-                    HASH_FIND_INT( *dh, &weak, sumItem );
-                    if(sumItem) {
-                        Digest_CalcStrong_Data2(buf1, buf2, fd->blockSize, i, strong);
-                        if (0 == memcmp(strong, sumItem->strong, CRS_STRONG_DIGEST_SIZE)) {
-                            dr->offsets[sumItem->seq] = offset;
-                        }
-                        HASH_ITER(hh, sumItem->sub, sumIter, sumTemp) {
-                            if (0 == memcmp(strong, sumIter->strong, CRS_STRONG_DIGEST_SIZE)) {
-                                dr->offsets[sumIter->seq] = offset;
-                            }
-                        }
-                    }
+    const size_t blockSize = fd->blockSize;
+    const int32_t localNum = local->fileSize / blockSize;
+    uint8_t *used = calloc(localNum + 1, 1); //last one is rest data, never matched
+    diffHash_t *sumItem = NULL, *sumIter = NULL, *sumTemp = NULL;
+
+    for(int32_t j=0; j<localNum; ++j) {
+        const digest_t *d = &local->blockDigest[j];
+        HASH_FIND_INT( *dh, &d->weak, sumItem );
+        if(sumItem) {
+            if (0 == memcmp(d->strong, sumItem->strong, CRS_STRONG_DIGEST_SIZE)) {
+                dr->offsets[sumItem->seq] = j * blockSize;
+                used[j] = 1;
+            }
+            HASH_ITER(hh, sumItem->sub, sumIter, sumTemp) {
+                if (0 == memcmp(d->strong, sumIter->strong, CRS_STRONG_DIGEST_SIZE)) {
+                    dr->offsets[sumIter->seq] = j * blockSize;
+                    used[j] = 1;
                 }
             }
+        }
+    }
 
-            free(buf1);
-            free(buf2);
-            fclose(file);
-        }//end of if(file)
-    }//end of omp parallel (DIFF_PARALLELISM_DEGREE)
+    int32_t missNum = 0;
+    for(int32_t i=0; i<dr->totalNum; ++i) {
+        if(dr->offsets[i] == -1) missNum++;
+    }
+    LOGI("local digest matched %d, still miss %d\n", dr->totalNum - missNum, missNum);
+
+    const size_t fileSize = local->fileSize;
+    const int32_t lastNum = (fileSize % blockSize > 0) ? localNum + 1 : localNum;
+    diffGap_t *gaps = (missNum > 0) ? malloc(sizeof(diffGap_t) * (lastNum + 1)) : NULL;
+    int32_t gapNum = 0;
+    for(int32_t j=0; missNum > 0 && j<lastNum; ) {
+        if(used[j]) {
+            ++j;
+            continue;
+        }
+        int32_t k = j;
+        while(k < lastNum && !used[k]) ++k;
+        //windows overlapping unmatched blocks [j, k)
+        size_t begin = (j * blockSize > blockSize - 1) ? (j * blockSize - (blockSize - 1)) : 0;
+        size_t end = k * blockSize + blockSize - 1;
+        if(end > fileSize) end = fileSize;
+        if(gapNum > 0 && begin <= gaps[gapNum-1].end) {
+            gaps[gapNum-1].end = end;
+        } else {
+            gaps[gapNum].begin = begin;
+            gaps[gapNum].end = end;
+            gapNum++;
+        }
+        j = k;
+    }
+    LOGI("rolling scan gaps = %d\n", gapNum);
 
-    for(int32_t i=0; i< dr->totalNum; ++i) {
-        if(dr->offsets[i] >= 0) {
-            dr->matchNum++;
+    if(gapNum > 0) {
+#pragma omp parallel shared(fd, dh, dr, gaps), num_threads(DIFF_PARALLELISM_DEGREE)
+        {
+            FILE *file = fopen(filename, "rb");
+#pragma omp for schedule(dynamic)
+            for(int32_t g=0; g<gapNum; ++g) {
+                if(file && gaps[g].end - gaps[g].begin >= blockSize) {
+                    Diff_scan(file, fd, dh, dr, gaps[g].begin, gaps[g].end);
+                }
+            }
+            if(file) fclose(file);
         }
     }
+
+    free(gaps);
+    free(used);
+    fileDigest_free(local);
+    return 0;
 }
 
 static CRScode Diff_cache(const char *dstFilename, const fileDigest_t *fd, diffResult_t *dr) {
@@ -303,9 +428,27 @@ CRScode Diff_perform(const char *srcFilename, const char *dstFilename, const fil
     }
 
     CRScode code = CRS_OK;
-    diffHash_t *dh = Diff_hash(fd);
+    diffHash_t *dh = Diff_hash(fd, NULL);
 
-    Diff_match(srcFilename, fd, (const diffHash_t **)&dh, dr);
+    dr->totalNum = fd->fileSize / fd->blockSize;
+    dr->matchNum = 0;
+    dr->cacheNum = 0;
+    fileDigest_free(dr->fine); //a refined result of the last diff
+    diffResult_free(dr->fineDr);
+    dr->fine = NULL;
+    dr->fineDr = NULL;
+    dr->offsets = malloc(dr->totalNum * sizeof(int32_t));
+    memset(dr->offsets, -1, dr->totalNum * sizeof(int32_t));
+
+    if(0 != Diff_local(srcFilename, fd, (const diffHash_t **)&dh, dr)) {
+        Diff_match(srcFilename, fd, (const diffHash_t **)&dh, dr);
+    }
+
+    for(int32_t i=0; i< dr->totalNum; ++i) {
+        if(dr->offsets[i] >= 0) {
+            dr->matchNum++;
+        }
+    }
 
     Diff_cache(dstFilename, fd, dr);
 
@@ -314,3 +457,167 @@ CRScode Diff_perform(const char *srcFilename, const char *dstFilename, const fil
     LOGI("end %d\n", code);
     return code;
 }
+
+int32_t Diff_seed(const char *seedFilename, const fileDigest_t *fd, const diffResult_t *dr, int32_t *seedOffsets) {
+    if(!seedFilename || !fd || !dr || !seedOffsets) {
+        return 0;
+    }
+    diffResult_t seedDr = *dr;
+    seedDr.offsets = seedOffsets;
+    memset(seedOffsets, -1, dr->totalNum * sizeof(int32_t));
+
+    diffHash_t *dh = Diff_hash(fd, dr);
+    if(!dh) {
+        return 0;
+    }
+    if(0 != Diff_local(seedFilename, fd, (const diffHash_t **)&dh, &seedDr)) {
+        struct stat st;
+        if(stat(seedFilename, &st) == 0 && (size_t)st.st_size <= fd->blockSize*DIFF_PARALLELISM_DEGREE) {
+            //Diff_match leaves small files alone, seeds are often small
+            FILE *file = fopen(seedFilename, "rb");
+            if(file && (size_t)st.st_size >= fd->blockSize) {
+                Diff_scan(file, fd, (const diffHash_t **)&dh, &seedDr, 0, st.st_size);
+            }
+            if(file) fclose(file);
+        } else {
+            Diff_match(seedFilename, fd, (const diffHash_t **)&dh, &seedDr);
+        }
+    }
+    diffHash_free(&dh);
+
+    int32_t found = 0;
+    for(int32_t i=0; i<dr->totalNum; ++i) {
+        if(seedOffsets[i] >= 0) found++;
+    }
+    return found;
+}
+
+//source windows of missing coarse runs: from the source of the matched block before a run
+//to the end of the matched block after it, file start or end if none; sorted and merged
+static int32_t Diff_refineGaps(const fileDigest_t *fd, const diffResult_t *dr, size_t srcSize, diffGap_t *gaps) {
+    const size_t blockSize = fd->blockSize;
+    int32_t gapNum = 0;
+    int32_t before = -1; //last matched coarse block
+    for(int32_t i=0; i<dr->totalNum; ) {
+        if(dr->offsets[i] != -1) {
+            if(dr->offsets[i] >= 0) before = i;
+            ++i;
+            continue;
+        }
+        int32_t j = i;
+        while(j < dr->totalNum && dr->offsets[j] < 0) ++j; //cached ones inside keep the run
+        size_t begin = (before >= 0) ? (size_t)dr->offsets[before] : 0;
+        size_t end = (j < dr->totalNum) ? (size_t)dr->offsets[j] + blockSize : srcSize;
+        if(end <= begin) { //moved around, take both neighbours' span
+            size_t t = begin;
+            begin = end - blockSize;
+            end = t + blockSize;
+        }
+        if(end > srcSize) end = srcSize;
+        gaps[gapNum].begin = begin;
+        gaps[gapNum].end = end;
+        gapNum++;
+        i = j;
+    }
+    qsort(gaps, gapNum, sizeof(diffGap_t), diffGap_cmp);
+    int32_t merged = 0;
+    for(int32_t g=0; g<gapNum; ++g) {
+        if(merged > 0 && gaps[g].begin <= gaps[merged-1].end) {
+            if(gaps[g].end > gaps[merged-1].end) gaps[merged-1].end = gaps[g].end;
+        } else {
+            gaps[merged++] = gaps[g];
+        }
+    }
+    return merged;
+}
+
+CRScode Diff_refine(const char *srcFilename, const char *dstFilename, const fileDigest_t *fd, const diffResult_t *dr,
+                    fileDigest_t *fine, diffResult_t *fineDr) {
+    LOGI("begin\n");
+    if(!srcFilename || !dstFilename || !fd || !dr || !fine || !fineDr || !fine->blockDigest ||
+       fine->fileSize != fd->fileSize || fine->blockSize == 0 || fd->blockSize % fine->blockSize != 0) {
+        LOGE("end %d\n", CRS_PARAM_ERROR);
+        return CRS_PARAM_ERROR;
+    }
+
+    CRScode code = CRS_OK;
+    const uint32_t fineSize = fine->blockSize;
+    const uint32_t k = fd->blockSize / fineSize;
+    const int32_t coarseNum = dr->totalNum;
+
+    fineDr->totalNum = fine->fileSize / fineSize;
+    fineDr->matchNum = 0;
+    fineDr->cacheNum = 0;
+    fineDr->offsets = malloc(fineDr->totalNum * sizeof(int32_t) + 1);
+    memset(fineDr->offsets, -1, fineDr->totalNum * sizeof(int32_t));
+
+    //fine blocks under matched and cached coarse blocks are local already, their digests stay unknown
+    for(int32_t i=0; i<coarseNum; ++i) {
+        if(dr->offsets[i] == -1) continue;
+        for(uint32_t j=0; j<k; ++j) {
+            fineDr->offsets[(size_t)i * k + j] = (dr->offsets[i] >= 0) ? (int32_t)(dr->offsets[i] + j * fineSize) : -2;
+        }
+    }
+
+    //fine blocks inside coarse rest data are local, patch writes them from fd->restData
+    size_t restBase = (size_t)coarseNum * k;
+    for(size_t n=restBase; n<(size_t)fineDr->totalNum; ++n) {
+        const uint8_t *p = fd->restData + (n - restBase) * fineSize;
+        Digest_CalcWeak_Data(p, fineSize, &fine->blockDigest[n].weak);
+        Digest_CalcStrong_Data(p, fineSize, fine->blockDigest[n].strong);
+        fineDr->offsets[n] = -2;
+    }
+    size_t restSize = fine->fileSize % fineSize;
+    free(fine->restData);
+    fine->restData = (restSize > 0) ? malloc(restSize) : NULL;
+    if(restSize > 0) {
+        memcpy(fine->restData, fd->restData + (fineDr->totalNum - restBase) * fineSize, restSize);
+    }
+
+    //fetched digests must belong to the same target file, a tree one can't be rebuilt from partial leaves,
+    //wrong leaves only fail downloads, the patched file is checked with fd at last
+    if(fine->digestMode != fd->digestMode ||
+       (fd->digestMode == DIGEST_MODE_FILE && 0 != memcmp(fine->fileDigest, fd->fileDigest, CRS_STRONG_DIGEST_SIZE))) {
+        code = CRS_PARAM_ERROR;
+    }
+    if(code != CRS_OK) {
+        LOGE("end fine digest not match target file\n");
+        return code;
+    }
+
+    //rolling scan with fine blocks still missing only, in source windows around them
+    diffHash_t *dh = Diff_hash(fine, fineDr);
+    struct stat st;
+    if(dh && stat(srcFilename, &st) == 0 && (size_t)st.st_size >= fineSize) {
+        diffGap_t *gaps = malloc(sizeof(diffGap_t) * (coarseNum + 1));
+        int32_t gapNum = Diff_refineGaps(fd, dr, st.st_size, gaps);
+        size_t scanBytes = 0;
+        for(int32_t g=0; g<gapNum; ++g) {
+            scanBytes += gaps[g].end - gaps[g].begin;
+        }
+        LOGI("rolling scan windows = %d, %luBytes\n", gapNum, (unsigned long)scanBytes);
+#pragma omp parallel shared(fine, dh, fineDr, gaps), num_threads(DIFF_PARALLELISM_DEGREE)
+        {
+            FILE *file = fopen(srcFilename, "rb");
+#pragma omp for schedule(dynamic)
+            for(int32_t g=0; g<gapNum; ++g) {
+                if(file && gaps[g].end - gaps[g].begin >= fineSize) {
+                    Diff_scan(file, fine, (const diffHash_t **)&dh, fineDr, gaps[g].begin, gaps[g].end);
+                }
+            }
+            if(file) fclose(file);
+        }
+        free(gaps);
+    }
+    diffHash_free(&dh);
+
+    for(int32_t i=0; i<fineDr->totalNum; ++i) {
+        if(fineDr->offsets[i] >= 0) {
+            fineDr->matchNum++;
+        } else if(fineDr->offsets[i] == -2) {
+            fineDr->cacheNum++;
+        }
+    }
+    LOGI("end %d\n", code);
+    return code;
+}
@@ -38,6 +38,8 @@ typedef struct diffResult_t {
     int32_t matchNum; //calc from fileDigest_t.offsets, compare to source file
     int32_t cacheNum; //dst file already got
     int32_t *offsets; //performed result, -1(default) miss, -2 cache, >=0 offset at source file;
+    fileDigest_t *fine; //smaller blocks to patch by, NULL if not refined
+    struct diffResult_t *fineDr; //result of fine
 } diffResult_t;
 
 diffResult_t* diffResult_malloc();
@@ -47,6 +49,15 @@ void diffResult_dump(const diffResult_t *dr);
 
 CRScode Diff_perform(const char *srcFilename, const char *dstFilename, const fileDigest_t *fd, diffResult_t *dr);
 
+//refine dr of fd with smaller blocks, fine needs block digests under dr's missing blocks only,
+//the others stay unknown and take dr's result. only source around missing blocks is scanned
+CRScode Diff_refine(const char *srcFilename, const char *dstFilename, const fileDigest_t *fd, const diffResult_t *dr,
+                    fileDigest_t *fine, diffResult_t *fineDr);
+
+//scan seedFilename, another local file, for blocks still missing in dr,
+//seedOffsets gets their offsets in seed, -1 if not found; return found Num
+int32_t Diff_seed(const char *seedFilename, const fileDigest_t *fd, const diffResult_t *dr, int32_t *seedOffsets);
+
 #if defined __cplusplus
 }
 #endif
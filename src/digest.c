@@ -24,14 +24,17 @@ SOFTWARE.
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <time.h>
 
 #include "digest.h"
 #include "md5.h"
 #include "log.h"
 #include "util.h"
 #include "tpl.h"
+#include "uthash.h"
 
 const char *DIGEST_EXT = ".sum";
+const char *DIGEST_CACHE_NAME = "crsync.sumcache";
 
 void Digest_CalcWeak_Data(const uint8_t *data, const uint32_t size, uint32_t *out) {
     uint32_t i = 0, a = 0, b = 0;
@@ -85,6 +88,88 @@ int Digest_CalcStrong_File(const char *filename, uint8_t *out) {
     //return blake2b_File(filename, out, CRS_STRONG_DIGEST_SIZE);
 }
 
+void Digest_CalcStrong_Init(strongCtx_t *ctx) {
+    MD5_Init(ctx);
+}
+
+void Digest_CalcStrong_Update(strongCtx_t *ctx, const uint8_t *data, const uint32_t len) {
+    MD5_Update(ctx, data, len);
+}
+
+void Digest_CalcStrong_Final(strongCtx_t *ctx, uint8_t *out) {
+    MD5_Final(ctx, out);
+}
+
+void Digest_CalcTree(const fileDigest_t *fd, uint8_t *out) {
+    strongCtx_t ctx;
+    Digest_CalcStrong_Init(&ctx);
+    uint32_t blockNum = fd->fileSize / fd->blockSize;
+    for(uint32_t i=0; i<blockNum; ++i) {
+        Digest_CalcStrong_Update(&ctx, fd->blockDigest[i].strong, CRS_STRONG_DIGEST_SIZE);
+    }
+    uint32_t restSize = fd->fileSize % fd->blockSize;
+    if(restSize > 0) {
+        Digest_CalcStrong_Update(&ctx, fd->restData, restSize);
+    }
+    Digest_CalcStrong_Final(&ctx, out);
+}
+
+int Digest_CalcFile(const char *filename, const fileDigest_t *fd, uint8_t *out) {
+    if(fd->digestMode != DIGEST_MODE_TREE) {
+        return Digest_CalcStrong_File(filename, out);
+    }
+    struct stat st;
+    if(stat(filename, &st) != 0 || (size_t)st.st_size != fd->fileSize) {
+        return -1;
+    }
+    fileDigest_t local = *fd;
+    uint32_t blockNum = fd->fileSize / fd->blockSize;
+    uint32_t restSize = fd->fileSize % fd->blockSize;
+    local.blockDigest = (blockNum > 0) ? malloc(sizeof(digest_t) * blockNum) : NULL;
+    local.restData = (restSize > 0) ? malloc(restSize) : NULL;
+    int ret = 0;
+
+#pragma omp parallel reduction(|:ret)
+    {
+        FILE *f = fopen(filename, "rb");
+        uint8_t *buf = malloc(fd->blockSize);
+#pragma omp for schedule(static)
+        for(int64_t i=0; i<(int64_t)blockNum; ++i) {
+            if(f && 0 == fseek(f, i * fd->blockSize, SEEK_SET) && fread(buf, 1, fd->blockSize, f) == fd->blockSize) {
+                Digest_CalcStrong_Data(buf, fd->blockSize, local.blockDigest[i].strong);
+            } else {
+                ret = -1;
+            }
+        }
+        free(buf);
+        if(f) fclose(f);
+    }
+
+    if(ret == 0 && restSize > 0) {
+        FILE *f = fopen(filename, "rb");
+        if(!f || 0 != fseek(f, (long)blockNum * fd->blockSize, SEEK_SET) || fread(local.restData, 1, restSize, f) != restSize) {
+            ret = -1;
+        }
+        if(f) fclose(f);
+    }
+    if(ret == 0) {
+        Digest_CalcTree(&local, out);
+    }
+    free(local.blockDigest);
+    free(local.restData);
+    return ret;
+}
+
+static uint32_t s_digestMode = DIGEST_MODE_FILE;
+
+void Digest_setMode(uint32_t mode) {
+    s_digestMode = mode;
+}
+
+uint32_t Digest_getMode() {
+    return s_digestMode;
+}
+
 fileDigest_t* fileDigest_malloc() {
     return calloc(1, sizeof(fileDigest_t));
 }
@@ -101,6 +186,7 @@ void fileDigest_dump(const fileDigest_t* fd) {
     if(fd) {
         LOGI("fileSize = %d\n", fd->fileSize);
         LOGI("blockSize = %d KiB\n", fd->blockSize/1024);
+        LOGI("digestMode = %d\n", fd->digestMode);
         char *hashString = Util_hex_string(fd->fileDigest, CRS_STRONG_DIGEST_SIZE);
         LOGI("fileDigest = %s\n", hashString);
         free(hashString);
@@ -166,51 +252,72 @@ CRScode Digest_Perform(const char *filename, const uint32_t blockSize, fileDiges
         return code;
     }
 
-    uint8_t fileDigest[CRS_STRONG_DIGEST_SIZE];
-    if(0 != Digest_CalcStrong_File(filename, fileDigest)) {
-        LOGE("end %s Digest_CalcStrong_File\n", filename);
-        return CRS_FILE_ERROR;
-    }
-
     fd->fileSize = st.st_size;
     fd->blockSize = blockSize;
+    fd->digestMode = s_digestMode;
     fd->blockDigest = digests;
     fd->restData = restData;
-    memcpy(fd->fileDigest, fileDigest, CRS_STRONG_DIGEST_SIZE);
+
+    if(fd->digestMode == DIGEST_MODE_TREE) {
+        Digest_CalcTree(fd, fd->fileDigest); //no second pass of file
+    } else if(0 != Digest_CalcStrong_File(filename, fd->fileDigest)) {
+        LOGE("end %s Digest_CalcStrong_File\n", filename);
+        return CRS_FILE_ERROR;
+    }
 
     LOGI("end %d\n", code);
     return code;
 }
 
 static const char *DIGEST_TPLMAP_FORMAT = "uuc#BA(uc#)";
+//DIGEST_MODE_TREE only, old clients keep reading DIGEST_MODE_FILE format
+static const char *DIGEST_TREE_TPLMAP_FORMAT = "uuuc#BA(uc#)";
 
-CRScode Digest_Load(const char *filename, fileDigest_t *fd) {
-    LOGI("begin\n");
-
-    if(!filename || !fd) {
-        LOGE("end %d\n", CRS_PARAM_ERROR);
-        return CRS_PARAM_ERROR;
+//mode TPL_FILE with filename, or TPL_MEM with data and size
+static int Digest_tplcmp(int mode, const char *filename, const void *data, size_t size, const char *fmt) {
+    if(mode == TPL_FILE) {
+        return Util_tplcmp(filename, fmt);
     }
-
-    if(0 != Digest_checkfile(filename)) {
-        LOGI("end %s miss\n", filename);
-        return CRS_FILE_ERROR;
+    char *f = tpl_peek(TPL_MEM, data, size);
+    int cmp = -1;
+    if(f) {
+        cmp = strncmp(f, fmt, strlen(fmt));
+        free(f);
     }
+    return cmp;
+}
 
+static CRScode Digest_loadTpl(int mode, const char *filename, const void *data, size_t size, fileDigest_t *fd) {
     CRScode code = CRS_OK;
     tpl_bin tb = {NULL, 0};
     digest_t digest;
 
-    tpl_node *tn = tpl_map( DIGEST_TPLMAP_FORMAT,
-                            &fd->fileSize,
-                            &fd->blockSize,
-                            fd->fileDigest,
-                            CRS_STRONG_DIGEST_SIZE,
-                            &tb,
-                            &digest.weak,
-                            &digest.strong,
-                            CRS_STRONG_DIGEST_SIZE);
-    if(0 == tpl_load(tn, TPL_FILE, filename)) {
+    tpl_node *tn = NULL;
+    if(0 == Digest_tplcmp(mode, filename, data, size, DIGEST_TREE_TPLMAP_FORMAT)) {
+        tn = tpl_map( DIGEST_TREE_TPLMAP_FORMAT,
+                      &fd->fileSize,
+                      &fd->blockSize,
+                      &fd->digestMode,
+                      fd->fileDigest,
+                      CRS_STRONG_DIGEST_SIZE,
+                      &tb,
+                      &digest.weak,
+                      &digest.strong,
+                      CRS_STRONG_DIGEST_SIZE);
+    } else {
+        fd->digestMode = DIGEST_MODE_FILE;
+        tn = tpl_map( DIGEST_TPLMAP_FORMAT,
+                      &fd->fileSize,
+                      &fd->blockSize,
+                      fd->fileDigest,
+                      CRS_STRONG_DIGEST_SIZE,
+                      &tb,
+                      &digest.weak,
+                      &digest.strong,
+                      CRS_STRONG_DIGEST_SIZE);
+    }
+    int loaded = (mode == TPL_FILE) ? tpl_load(tn, TPL_FILE, filename) : tpl_load(tn, TPL_MEM, data, size);
+    if(0 == loaded) {
         tpl_unpack(tn, 0);
 
         uint32_t blockNum = fd->fileSize / fd->blockSize;
@@ -223,16 +330,51 @@ CRScode Digest_Load(const char *filename, fileDigest_t *fd) {
             memcpy(fd->blockDigest[i].strong, digest.strong, CRS_STRONG_DIGEST_SIZE);
         }
     } else {
-        LOGE("error tpl_load %s\n", filename);
+        LOGE("error tpl_load %s\n", filename ? filename : "memory");
         code = CRS_FILE_ERROR;
     }
     tpl_free(tn);
+    return code;
+}
+
+CRScode Digest_Load(const char *filename, fileDigest_t *fd) {
+    LOGI("begin\n");
+
+    if(!filename || !fd) {
+        LOGE("end %d\n", CRS_PARAM_ERROR);
+        return CRS_PARAM_ERROR;
+    }
+
+    if(0 != Digest_checkfile(filename)) {
+        LOGI("end %s miss\n", filename);
+        return CRS_FILE_ERROR;
+    }
 
+    CRScode code = Digest_loadTpl(TPL_FILE, filename, NULL, 0, fd);
     LOGI("end %d\n", code);
     return code;
 }
 
-CRScode Digest_Save(const char *filename, fileDigest_t *fd) {
+CRScode Digest_LoadMemory(const void *data, size_t size, fileDigest_t *fd) {
+    LOGI("begin\n");
+
+    if(!data || !fd) {
+        LOGE("end %d\n", CRS_PARAM_ERROR);
+        return CRS_PARAM_ERROR;
+    }
+
+    if(0 != Digest_tplcmp(TPL_MEM, NULL, data, size, DIGEST_TREE_TPLMAP_FORMAT) &&
+       0 != Digest_tplcmp(TPL_MEM, NULL, data, size, DIGEST_TPLMAP_FORMAT)) {
+        LOGE("end memory not digest\n");
+        return CRS_FILE_ERROR;
+    }
+
+    CRScode code = Digest_loadTpl(TPL_MEM, NULL, data, size, fd);
+    LOGI("end %d\n", code);
+    return code;
+}
+
+CRScode Digest_Save(const char *filename, const fileDigest_t *fd) {
     LOGI("begin\n");
 
     if(!filename || !fd) {
@@ -247,15 +389,29 @@ CRScode Digest_Save(const char *filename, fileDigest_t *fd) {
 
     digest_t digest;
 
-    tpl_node *tn = tpl_map( DIGEST_TPLMAP_FORMAT,
-                            &fd->fileSize,
-                            &fd->blockSize,
-                            fd->fileDigest,
-                            CRS_STRONG_DIGEST_SIZE,
-                            &tb,
-                            &digest.weak,
-                            &digest.strong,
-                            CRS_STRONG_DIGEST_SIZE);
+    tpl_node *tn = NULL;
+    if(fd->digestMode == DIGEST_MODE_TREE) {
+        tn = tpl_map( DIGEST_TREE_TPLMAP_FORMAT,
+                      (void*)&fd->fileSize,
+                      (void*)&fd->blockSize,
+                      (void*)&fd->digestMode,
+                      (void*)fd->fileDigest,
+                      CRS_STRONG_DIGEST_SIZE,
+                      &tb,
+                      &digest.weak,
+                      &digest.strong,
+                      CRS_STRONG_DIGEST_SIZE);
+    } else {
+        tn = tpl_map( DIGEST_TPLMAP_FORMAT,
+                      (void*)&fd->fileSize,
+                      (void*)&fd->blockSize,
+                      (void*)fd->fileDigest,
+                      CRS_STRONG_DIGEST_SIZE,
+                      &tb,
+                      &digest.weak,
+                      &digest.strong,
+                      CRS_STRONG_DIGEST_SIZE);
+    }
     tpl_pack(tn, 0);
 
     uint32_t blockNum = fd->fileSize / fd->blockSize;
@@ -276,5 +432,197 @@ CRScode Digest_Save(const char *filename, fileDigest_t *fd) {
 }
 
 int Digest_checkfile(const char *filename) {
+    if(0 == Util_tplcmp(filename, DIGEST_TREE_TPLMAP_FORMAT)) {
+        return 0;
+    }
     return Util_tplcmp(filename, DIGEST_TPLMAP_FORMAT);
 }
+
+//name, size, mtime, inode, checked, digest
+static const char *DIGEST_CACHE_TPLMAP_FORMAT = "A(sUUUUc#)";
+
+typedef struct digestCache_t {
+    char            *name; //key, file name inside cache dir
+    uint64_t        size;
+    uint64_t        mtime;
+    uint64_t        inode;
+    uint64_t        checked; //time digest taken, file modified in the same second is not trusted
+    uint8_t         digest[CRS_STRONG_DIGEST_SIZE];
+    UT_hash_handle  hh;
+} digestCache_t;
+
+//guarded by omp critical (digest_cache)
+static digestCache_t *s_cache = NULL;
+static char *s_cacheDir = NULL;
+static int s_cacheDirty = 0;
+
+static void Digest_cacheFree() {
+    digestCache_t *item = NULL, *tmp = NULL;
+    HASH_ITER(hh, s_cache, item, tmp) {
+        HASH_DEL(s_cache, item);
+        free(item->name);
+        free(item);
+    }
+    free(s_cacheDir);
+    s_cacheDir = NULL;
+    s_cacheDirty = 0;
+}
+
+//file name inside loaded dir, NULL if not there
+static const char* Digest_cacheName(const char *filename) {
+    size_t len = s_cacheDir ? strlen(s_cacheDir) : 0;
+    if(len == 0 || 0 != strncmp(filename, s_cacheDir, len)) return NULL;
+    const char *name = filename + len;
+    return (*name != '\0' && !strchr(name, '/')) ? name : NULL;
+}
+
+static int Digest_cacheValid(const digestCache_t *item, const struct stat *st) {
+    return item->size == (uint64_t)st->st_size && item->mtime == (uint64_t)st->st_mtime &&
+           item->inode == (uint64_t)st->st_ino && item->checked > (uint64_t)st->st_mtime;
+}
+
+static CRScode Digest_cacheDump() {
+    CRScode code = CRS_OK;
+    char *cacheFilename = Util_strcat(s_cacheDir, DIGEST_CACHE_NAME);
+    digestCache_t entry;
+    tpl_node *tn = tpl_map(DIGEST_CACHE_TPLMAP_FORMAT,
+                           &entry.name,
+                           &entry.size,
+                           &entry.mtime,
+                           &entry.inode,
+                           &entry.checked,
+                           entry.digest,
+                           CRS_STRONG_DIGEST_SIZE);
+    digestCache_t *item = NULL, *tmp = NULL;
+    HASH_ITER(hh, s_cache, item, tmp) {
+        char *f = Util_strcat(s_cacheDir, item->name);
+        struct stat st;
+        if(stat(f, &st) != 0 || !Digest_cacheValid(item, &st)) {
+            HASH_DEL(s_cache, item);
+            free(item->name);
+            free(item);
+        } else {
+            entry = *item;
+            tpl_pack(tn, 1);
+        }
+        free(f);
+    }
+    if(0 != tpl_dump(tn, TPL_FILE, cacheFilename)) {
+        LOGE("error tpl_dump %s\n", cacheFilename);
+        code = CRS_FILE_ERROR;
+    }
+    tpl_free(tn);
+    free(cacheFilename);
+    s_cacheDirty = 0;
+    return code;
+}
+
+CRScode Digest_cacheLoad(const char *dir) {
+    LOGI("begin\n");
+    if(!dir) {
+        LOGE("end %d\n", CRS_PARAM_ERROR);
+        return CRS_PARAM_ERROR;
+    }
+    CRScode code = CRS_OK;
+#pragma omp critical (digest_cache)
+    {
+        if(!s_cacheDir || 0 != strcmp(s_cacheDir, dir)) {
+            if(s_cacheDir && s_cacheDirty) {
+                Digest_cacheDump();
+            }
+            Digest_cacheFree();
+            s_cacheDir = strdup(dir);
+            char *cacheFilename = Util_strcat(dir, DIGEST_CACHE_NAME);
+            if(0 == Util_tplcmp(cacheFilename, DIGEST_CACHE_TPLMAP_FORMAT)) {
+                digestCache_t entry;
+                tpl_node *tn = tpl_map(DIGEST_CACHE_TPLMAP_FORMAT,
+                                       &entry.name,
+                                       &entry.size,
+                                       &entry.mtime,
+                                       &entry.inode,
+                                       &entry.checked,
+                                       entry.digest,
+                                       CRS_STRONG_DIGEST_SIZE);
+                if(0 == tpl_load(tn, TPL_FILE, cacheFilename)) {
+                    while(tpl_unpack(tn, 1) > 0) {
+                        digestCache_t *item = malloc(sizeof(digestCache_t));
+                        *item = entry; //name allocated by tpl_unpack
+                        HASH_ADD_KEYPTR(hh, s_cache, item->name, strlen(item->name), item);
+                    }
+                } else {
+                    code = CRS_FILE_ERROR;
+                }
+                tpl_free(tn);
+            }
+            free(cacheFilename);
+            LOGI("%u entries\n", HASH_COUNT(s_cache));
+        }
+    }
+    LOGI("end %d\n", code);
+    return code;
+}
+
+CRScode Digest_cacheSave() {
+    LOGI("begin\n");
+    CRScode code = CRS_OK;
+#pragma omp critical (digest_cache)
+    {
+        if(s_cacheDir && s_cacheDirty) {
+            code = Digest_cacheDump();
+        }
+    }
+    LOGI("end %d\n", code);
+    return code;
+}
+
+static void Digest_cachePut(const char *name, const struct stat *st, const uint8_t *digest, time_t checked) {
+    digestCache_t *item = NULL;
+    HASH_FIND(hh, s_cache, name, strlen(name), item);
+    if(!item) {
+        item = calloc(1, sizeof(digestCache_t));
+        item->name = strdup(name);
+        HASH_ADD_KEYPTR(hh, s_cache, item->name, strlen(item->name), item);
+    }
+    item->size = st->st_size;
+    item->mtime = st->st_mtime;
+    item->inode = st->st_ino;
+    item->checked = checked;
+    memcpy(item->digest, digest, CRS_STRONG_DIGEST_SIZE);
+    s_cacheDirty = 1;
+}
+
+int Digest_CalcStrong_Cached(const char *filename, uint8_t *out) {
+    time_t checked = time(NULL);
+    struct stat st;
+    if(!filename || stat(filename, &st) != 0) {
+        return Digest_CalcStrong_File(filename, out);
+    }
+    int found = 0;
+#pragma omp critical (digest_cache)
+    {
+        const char *name = Digest_cacheName(filename);
+        digestCache_t *item = NULL;
+        if(name) {
+            HASH_FIND(hh, s_cache, name, strlen(name), item);
+        }
+        if(item && Digest_cacheValid(item, &st)) {
+            memcpy(out, item->digest, CRS_STRONG_DIGEST_SIZE);
+            found = 1;
+        }
+    }
+    if(found) {
+        return 0;
+    }
+    //st and checked taken before reading, a change while reading fails next check
+    int ret = Digest_CalcStrong_File(filename, out);
+    if(ret == 0) {
+#pragma omp critical (digest_cache)
+        {
+            const char *name = Digest_cacheName(filename);
+            if(name) {
+                Digest_cachePut(name, &st, out, checked);
+            }
+        }
+    }
+    return ret;
+}
@@ -31,6 +31,7 @@ extern "C" {
 #include <stdint.h>
 
 #include "global.h"
+#include "md5.h"
 
 extern const char *DIGEST_EXT;
 
@@ -41,14 +42,26 @@ void Digest_CalcStrong_Data(const uint8_t *data, const uint32_t len, uint8_t *ou
 void Digest_CalcStrong_Data2(const uint8_t *buf1, const uint8_t *buf2, const uint32_t size, const uint32_t offset, uint8_t *out);
 int  Digest_CalcStrong_File(const char *filename, uint8_t *out);
 
+//streaming strong digest, same result as Digest_CalcStrong_Data
+typedef MD5_CTX strongCtx_t;
+void Digest_CalcStrong_Init(strongCtx_t *ctx);
+void Digest_CalcStrong_Update(strongCtx_t *ctx, const uint8_t *data, const uint32_t len);
+void Digest_CalcStrong_Final(strongCtx_t *ctx, uint8_t *out);
+
 typedef struct digest_t {
     uint8_t     strong[CRS_STRONG_DIGEST_SIZE]; // strong digest (md5, blake2 etc.)
     uint32_t    weak; // Adler32, used for Rolling calc
 } digest_t;
 
+typedef enum {
+    DIGEST_MODE_FILE = 0, //fileDigest is strong sum of whole file
+    DIGEST_MODE_TREE, //fileDigest is strong sum of all blocks' strong and rest data
+} DIGESTmode;
+
 typedef struct fileDigest_t {
     uint32_t    fileSize; //file size
     uint32_t    blockSize; //block size
+    uint32_t    digestMode; //DIGESTmode, how fileDigest calculated
     uint8_t     fileDigest[CRS_STRONG_DIGEST_SIZE]; //file strong sum
     digest_t    *blockDigest; //every block's rsum_t data
     uint8_t     *restData; //rest binary data, size = fileSize % blockSize
@@ -58,11 +71,33 @@ fileDigest_t* fileDigest_malloc();
 void          fileDigest_free(fileDigest_t* fd);
 void          fileDigest_dump(const fileDigest_t* fd);
 
+//fileDigest of DIGEST_MODE_TREE, from block digests without file io
+void Digest_CalcTree(const fileDigest_t *fd, uint8_t *out);
+//fileDigest of filename in fd's mode, tree mode in parallel
+int  Digest_CalcFile(const char *filename, const fileDigest_t *fd, uint8_t *out);
+
+//DIGESTmode used by Digest_Perform, default DIGEST_MODE_FILE
+void    Digest_setMode(uint32_t mode);
+uint32_t Digest_getMode();
+
 CRScode Digest_Perform(const char *filename, const uint32_t blockSize, fileDigest_t *fd);
 CRScode Digest_Load(const char *filename, fileDigest_t *fd);
-CRScode Digest_Save(const char *filename, fileDigest_t *fd);
+//same as Digest_Load, from a .sum image in memory
+CRScode Digest_LoadMemory(const void *data, size_t size, fileDigest_t *fd);
+CRScode Digest_Save(const char *filename, const fileDigest_t *fd);
 int     Digest_checkfile(const char *filename);
 
+//whole file strong digests of one directory's files, saved in it as DIGEST_CACHE_NAME,
+//an entry is valid while the file's size, mtime and inode unchanged
+extern const char *DIGEST_CACHE_NAME;
+
+//load dir's cache, dir ends with '/', the one loaded before saved and dropped
+CRScode Digest_cacheLoad(const char *dir);
+//save loaded cache if changed, entries of missing or changed files dropped
+CRScode Digest_cacheSave();
+//Digest_CalcStrong_File, from cache if filename in loaded dir and unchanged
+int     Digest_CalcStrong_Cached(const char *filename, uint8_t *out);
+
 #if defined __cplusplus
 }
 #endif
@@ -24,6 +24,14 @@ SOFTWARE.
 #include <sys/stat.h>
 #include <stdio.h>
 #include <errno.h>
+#include <ctype.h>
+#include <omp.h>
+
+#ifdef _MSC_VER
+#   include "win/dirent.h"
+#else
+#   include <dirent.h>
+#endif
 
 #include "helper.h"
 #include "crsync.h"
@@ -41,6 +49,7 @@ void helper_free(helper_t *h) {
         free(elt->fileName);
         fileDigest_free(elt->fd);
         diffResult_free(elt->dr);
+        free(elt->borrow);
         free(elt);
     }
 }
@@ -64,6 +73,9 @@ CRScode helper_perform_diff(helper_t *h) {
     h->fd = NULL;
     diffResult_free(h->dr);
     h->dr = NULL;
+    free(h->borrow);
+    h->borrow = NULL;
+    h->borrowNum = 0;
 
     CRScode code = CRS_OK;
     do {
@@ -80,7 +92,7 @@ CRScode helper_perform_diff(helper_t *h) {
                 if((size_t)stDst.st_size == h->fileSize) {
                     LOGI("dst-File size == target-File size; let's compare digest\n");
                     uint8_t digest[CRS_STRONG_DIGEST_SIZE];
-                    Digest_CalcStrong_File(srcFullName, digest);
+                    Digest_CalcStrong_Cached(srcFullName, digest);
                     if(0 == memcmp(digest, h->fileDigest, CRS_STRONG_DIGEST_SIZE)) {
                         LOGI("Yeah: dst-File digest == target-File digest\n");
                         h->cacheSize = h->fileSize;
@@ -105,7 +117,7 @@ CRScode helper_perform_diff(helper_t *h) {
         if((size_t)stSrc.st_size == h->fileSize) {
             LOGI("src-File size == target-File size; let's compare digest\n");
             uint8_t srcDigest[CRS_STRONG_DIGEST_SIZE];
-            Digest_CalcStrong_File(srcFullName, srcDigest);
+            Digest_CalcStrong_Cached(srcFullName, srcDigest);
             if(0 == memcmp(srcDigest, h->fileDigest, CRS_STRONG_DIGEST_SIZE)) {
                 LOGI("Yeah: src-File digest == target-File digest\n");
                 h->cacheSize = h->fileSize;
@@ -136,6 +148,37 @@ CRScode helper_perform_diff(helper_t *h) {
     return code;
 }
 
+//borrow blocks of owners patched, others left missing and downloaded
+static patchBorrow_t* helper_borrow(const helper_t *h) {
+    if(h->borrowNum == 0) return NULL;
+    patchBorrow_t *borrow = calloc(h->borrowNum, sizeof(patchBorrow_t));
+    for(uint32_t k=0; k<h->borrowNum; ++k) {
+        const helperBorrow_t *b = &h->borrow[k];
+        borrow[k].seq = -1;
+        if(b->owner && !b->owner->isComplete) continue;
+        if(k > 0 && b->owner == h->borrow[k-1].owner && b->seed == h->borrow[k-1].seed) {
+            borrow[k].filename = borrow[k-1].filename; //owners in runs, name shared
+        } else if(b->owner) {
+            borrow[k].filename = Util_strcat(b->owner->fileDir, b->owner->fileName);
+        } else {
+            borrow[k].filename = strdup(b->seed);
+        }
+        borrow[k].offset = b->offset;
+        borrow[k].seq = b->seq;
+    }
+    return borrow;
+}
+
+static void helper_borrowFree(patchBorrow_t *borrow, uint32_t borrowNum) {
+    if(!borrow) return;
+    for(uint32_t k=0; k<borrowNum; ++k) {
+        if(borrow[k].filename && (k == 0 || borrow[k].filename != borrow[k-1].filename)) {
+            free((char*)borrow[k].filename);
+        }
+    }
+    free(borrow);
+}
+
 CRScode helper_perform_patch(helper_t *h) {
     LOGI("begin\n");
     if(!h) {
@@ -159,9 +202,13 @@ CRScode helper_perform_patch(helper_t *h) {
     do {
         struct stat stSrc;
         struct stat stDst;
+        int seeded = 0; //new file, but diffed with other local files
         if(stat(srcFullName, &stSrc) != 0) {
             LOGI("src-File NotExist\n");
-            if(stat(dstFullName, &stDst) != 0 || (size_t)stDst.st_size < h->fileSize) {
+            if(h->fd && h->dr && h->borrowNum > 0) {
+                LOGI("other local files have some blocks, patch without src-File\n");
+                seeded = 1;
+            } else if(stat(dstFullName, &stDst) != 0 || (size_t)stDst.st_size < h->fileSize) {
                 LOGI("dst-File NotExist or < target-File, download it\n");
                 code = HTTP_File(url, dstFullName, 5, h->fileName);
                 if(stat(dstFullName, &stDst) == 0) {
@@ -182,7 +229,9 @@ CRScode helper_perform_patch(helper_t *h) {
         }
 
         LOGI("check src-File status\n");
-        if(stat(srcFullName, &stSrc) != 0) {
+        if(seeded) {
+            LOGI("src-File NotExist as expected\n");
+        } else if(stat(srcFullName, &stSrc) != 0) {
             LOGE("WTF: src-File still not exist!\n");
             code = CRS_BUG;
             break;
@@ -193,10 +242,10 @@ CRScode helper_perform_patch(helper_t *h) {
         crs_callback_patch(h->fileName, h->cacheSize, h->isComplete, 1);
 
         LOGI("let's compare size\n");
-        if((size_t)stSrc.st_size == h->fileSize) {
+        if(!seeded && (size_t)stSrc.st_size == h->fileSize) {
             LOGI("size : src-File == target-File; let's compare digest\n");
             uint8_t srcDigest[CRS_STRONG_DIGEST_SIZE];
-            Digest_CalcStrong_File(srcFullName, srcDigest);
+            Digest_CalcStrong_Cached(srcFullName, srcDigest);
             if(0 == memcmp(srcDigest, h->fileDigest, CRS_STRONG_DIGEST_SIZE)) {
                 LOGI("digest : src-File == target-File\n");
                 code = CRS_OK;
@@ -231,10 +280,30 @@ CRScode helper_perform_patch(helper_t *h) {
             }
         }
 
-        code = crs_perform_patch(srcFullName, dstFullName, url, h->fd, h->dr);
+        patchOption_t opt;
+        Patch_getOption(&opt);
+        if(opt.inplace && !seeded) {
+            LOGI("patch src-File in place\n");
+            code = crs_perform_inplace(srcFullName, url, h->fd, h->dr);
+            if(code == CRS_OK) {
+                h->isComplete = 1;
+                h->cacheSize = h->fileSize;
+            }
+            break;
+        }
+
+        patchBorrow_t *borrow = helper_borrow(h);
+        code = crs_perform_borrow(srcFullName, dstFullName, url, h->fd, h->dr, borrow, h->borrowNum);
+        helper_borrowFree(borrow, h->borrowNum);
         if(code == CRS_OK) {
             LOGI("Patch OK, crs_perform_patch make sure fileDigest right\n");
             Util_filemove(dstFullName, srcFullName);
+            LOGI("keep dst-File digest as src-File local digest\n");
+            char *srcDigestName = Util_strcat(srcFullName, DIGEST_EXT);
+            char *dstDigestName = Util_strcat(dstFullName, DIGEST_EXT);
+            Util_filemove(dstDigestName, srcDigestName);
+            free(srcDigestName);
+            free(dstDigestName);
             h->isComplete = 1;
             h->cacheSize = h->fileSize;
         }
@@ -250,6 +319,9 @@ CRScode helper_perform_patch(helper_t *h) {
     h->fd = NULL;
     diffResult_free(h->dr);
     h->dr = NULL;
+    free(h->borrow);
+    h->borrow = NULL;
+    h->borrowNum = 0;
 
     crs_callback_patch(h->fileName, h->cacheSize, h->isComplete, 1);
 
@@ -262,12 +334,26 @@ bulkHelper_t * bulkHelper_malloc() {
     return bh;
 }
 
+//currentBulk is one array made by perform_bulklist, names ref to currentMagnet
+static void bulkList_free(helper_t *bulk) {
+    for(helper_t *elt = bulk; elt; elt = elt->next) {
+        fileDigest_free(elt->fd);
+        diffResult_free(elt->dr);
+        free(elt->borrow);
+    }
+    free(bulk);
+}
+
 void bulkHelper_free(bulkHelper_t *bh) {
     if(bh) {
         free(bh->fileDir);
         free(bh->baseUrl);
+        bulkList_free(bh->currentBulk);
         magnet_free(bh->currentMagnet);
-        helper_free(bh->currentBulk);
+        for(uint32_t i=0; i<bh->seedNum; ++i) {
+            free(bh->seeds[i]);
+        }
+        free(bh->seeds);
         free(bh);
     }
 }
@@ -353,12 +439,284 @@ CRScode bulkHelper_set_magnet(bulkHelper_t *bh, const char *magnetString) {
     utstring_printf(str, "%s", magnetString);
     magnet_t *m = magnet_fromString(&str);
     utstring_free(str);
-    free(bh->currentMagnet);
+    bulkList_free(bh->currentBulk);
+    bh->currentBulk = NULL;
+    magnet_free(bh->currentMagnet);
     bh->currentMagnet = m;
     LOGI("end %d\n", code);
     return code;
 }
 
+static bulkOption_t s_bulkOption = {
+    0,              //diffThreads cpu count
+    2,              //patchThreads
+    64*1024*1024,   //memoryLimit 64MB
+    0,              //seeds
+    1,              //delta
+};
+
+//magnet of the version installed in fileDir, saved when a bulk update completes
+static const char *BULK_INSTALLED_NAME = "crsync.installed";
+
+static char* bulkInstalled_name(const bulkHelper_t *bh) {
+    char *name = Util_strcat(bh->fileDir, BULK_INSTALLED_NAME);
+    char *nameExt = Util_strcat(name, MAGNET_EXT);
+    free(name);
+    return nameExt;
+}
+
+static magnet_t* bulkInstalled_load(const bulkHelper_t *bh) {
+    if(!bh->fileDir) return NULL;
+    char *name = bulkInstalled_name(bh);
+    magnet_t *m = NULL;
+    if(0 == Magnet_checkfile(name)) {
+        m = magnet_malloc();
+        if(CRS_OK != magnet_load(m, name)) {
+            magnet_free(m);
+            m = NULL;
+        }
+    }
+    free(name);
+    return m;
+}
+
+//files same (name, size, digest) as installed are complete, never stat or hashed
+static void bulkInstalled_skip(bulkHelper_t *bh) {
+    magnet_t *installed = bulkInstalled_load(bh);
+    if(!installed) return;
+    const magnet_t *m = bh->currentMagnet;
+    magnetDelta_t delta;
+    magnet_delta(installed, m, &delta);
+    uint8_t *work = calloc(m->fileNum + 1, 1);
+    for(uint32_t k=0; k<delta.addedNum; ++k) work[delta.added[k]] = 1;
+    for(uint32_t k=0; k<delta.changedNum; ++k) work[delta.changed[k]] = 1;
+    helper_t *bulk = bh->currentBulk;
+    for(uint32_t i=0; i<m->fileNum; ++i) {
+        if(!work[i]) {
+            bulk[i].isComplete = 1;
+            bulk[i].cacheSize = bulk[i].fileSize;
+        }
+    }
+    LOGI("installed %u files, added %u changed %u removed %u\n",
+         installed->fileNum, delta.addedNum, delta.changedNum, delta.removedNum);
+    free(work);
+    magnetDelta_free(&delta);
+    magnet_free(installed);
+}
+
+typedef struct foldName_t {
+    char            *name; //key, lower case
+    const char      *orig; //ref to magnet
+    UT_hash_handle  hh;
+} foldName_t;
+
+static char* bulkInstalled_fold(const char *name) {
+    char *fold = strdup(name);
+    for(char *p=fold; *p; ++p) {
+        *p = tolower((unsigned char)*p);
+    }
+    return fold;
+}
+
+//dropped name equal to a current one but case, the same file unless their inodes differ;
+//no inode (0 on windows) or no file keeps it
+static int bulkInstalled_sameFile(const char *dir, const char *dropped, const char *current) {
+    char *a = Util_strcat(dir, dropped);
+    char *b = Util_strcat(dir, current);
+    struct stat sa, sb;
+    int same = (stat(a, &sa) != 0 || stat(b, &sb) != 0 || sa.st_ino == 0 ||
+                (sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino));
+    free(a);
+    free(b);
+    return same;
+}
+
+//every file complete: remove files installed before but dropped now, then record currentMagnet.
+//a case-insensitive filesystem sees A.png renamed to a.png as one file, never removed
+static void bulkInstalled_commit(bulkHelper_t *bh) {
+    if(!bh->fileDir || !bh->currentMagnet) return;
+    helper_t *elt = NULL;
+    LL_FOREACH(bh->currentBulk, elt) {
+        if(!elt->isComplete) return;
+    }
+    magnet_t *installed = s_bulkOption.delta ? bulkInstalled_load(bh) : NULL;
+    if(installed) {
+        magnetDelta_t delta;
+        magnet_delta(installed, bh->currentMagnet, &delta);
+        const magnet_t *m = bh->currentMagnet;
+        foldName_t *folds = NULL, *item = NULL, *tmp = NULL;
+        for(uint32_t i=0; i<m->fileNum && delta.removedNum > 0; ++i) {
+            item = calloc(1, sizeof(foldName_t));
+            item->orig = magnet_name(m, &m->file[i]);
+            item->name = bulkInstalled_fold(item->orig);
+            HASH_ADD_KEYPTR(hh, folds, item->name, strlen(item->name), item);
+        }
+        for(uint32_t k=0; k<delta.removedNum; ++k) {
+            const char *name = magnet_name(installed, &installed->file[delta.removed[k]]);
+            char *fold = bulkInstalled_fold(name);
+            HASH_FIND_STR(folds, fold, item);
+            free(fold);
+            if(item && bulkInstalled_sameFile(bh->fileDir, name, item->orig)) {
+                LOGI("%s renamed by case only, kept\n", name);
+                continue;
+            }
+            char *file = Util_strcat(bh->fileDir, name);
+            char *fileDigest = Util_strcat(file, DIGEST_EXT);
+            LOGI("%s removed\n", file);
+            remove(file);
+            remove(fileDigest);
+            free(file);
+            free(fileDigest);
+        }
+        HASH_ITER(hh, folds, item, tmp) {
+            HASH_DEL(folds, item);
+            free(item->name);
+            free(item);
+        }
+        magnetDelta_free(&delta);
+        magnet_free(installed);
+    }
+    //a torn file fails magnet_load checks, next update then checks every file
+    char *name = bulkInstalled_name(bh);
+    magnet_save(bh->currentMagnet, name);
+    free(name);
+}
+
+//helper_t list of magnet's files, once, in one array
+static void perform_bulklist(bulkHelper_t *bh, const magnet_t *m) {
+    if(!bh->currentBulk && m->fileNum > 0) {
+        helper_t *bulk = calloc(m->fileNum, sizeof(helper_t));
+        for(uint32_t i=0; i<m->fileNum; ++i) {
+            const sum_t *s = &m->file[i];
+            helper_t *h = &bulk[i];
+            h->fileDir = bh->fileDir;
+            h->baseUrl = bh->baseUrl;
+            h->fileName = (char*)magnet_name(m, s);
+            h->fileSize = s->size;
+            memcpy(h->fileDigest, s->digest, CRS_STRONG_DIGEST_SIZE);
+            h->next = (i + 1 < m->fileNum) ? &bulk[i + 1] : NULL;
+        }
+        bh->currentBulk = bulk;
+        if(s_bulkOption.delta) {
+            bulkInstalled_skip(bh);
+        }
+    }
+}
+
+void bulkHelper_getOption(bulkOption_t *opt) {
+    if(opt) *opt = s_bulkOption;
+}
+
+void bulkHelper_setOption(const bulkOption_t *opt) {
+    if(opt) s_bulkOption = *opt;
+}
+
+//every local file of fileDir except digests and magnets
+static void bulkSeed_list(bulkHelper_t *bh) {
+    for(uint32_t i=0; i<bh->seedNum; ++i) {
+        free(bh->seeds[i]);
+    }
+    free(bh->seeds);
+    bh->seeds = NULL;
+    bh->seedNum = 0;
+    if(!s_bulkOption.seeds || !bh->fileDir) return;
+
+    DIR *dirp = opendir(bh->fileDir);
+    if(!dirp) return;
+    uint32_t cap = 0;
+    struct dirent *direntp = NULL;
+    while ((direntp = readdir(dirp)) != NULL) {
+        if(strstr(direntp->d_name, DIGEST_EXT) || strstr(direntp->d_name, MAGNET_EXT)) {
+            continue;
+        }
+        char *f = Util_strcat(bh->fileDir, direntp->d_name);
+        struct stat st;
+        if(stat(f, &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG) {
+            free(f);
+            continue;
+        }
+        if(bh->seedNum == cap) {
+            cap = (cap > 0) ? cap * 2 : 16;
+            bh->seeds = realloc(bh->seeds, sizeof(char*) * cap);
+        }
+        bh->seeds[bh->seedNum++] = f;
+    }
+    closedir(dirp);
+    LOGI("seed files Num = %u\n", bh->seedNum);
+}
+
+//h's missing blocks found in seeds become h's borrow, new file diffed here first
+static void bulkSeed_diff(const bulkHelper_t *bh, helper_t *h) {
+    patchOption_t opt;
+    Patch_getOption(&opt);
+    if(bh->seedNum == 0 || h->isComplete || opt.inplace) return;
+
+    char *srcFullName = Util_strcat(h->fileDir, h->fileName);
+    char *digestString = Util_hex_string(h->fileDigest, CRS_STRONG_DIGEST_SIZE);
+    char *dstFullName = Util_strcat(h->fileDir, digestString);
+    char *url = Util_strcat(h->baseUrl, digestString);
+    char *digestUrl = Util_strcat(url, DIGEST_EXT);
+
+    do {
+        if(!h->fd || !h->dr) {
+            struct stat stDst;
+            if(stat(dstFullName, &stDst) == 0) {
+                LOGI("%s resume download, no seeds\n", h->fileName);
+                break;
+            }
+            h->fd = fileDigest_malloc();
+            h->dr = diffResult_malloc();
+            if(CRS_OK != crs_perform_diff(srcFullName, dstFullName, digestUrl, h->fd, h->dr)) {
+                LOGI("%s digest miss, no seeds\n", h->fileName);
+                fileDigest_free(h->fd);
+                h->fd = NULL;
+                diffResult_free(h->dr);
+                h->dr = NULL;
+                break;
+            }
+        }
+
+        //blocks found in one seed are not missing for next seeds
+        const int32_t totalNum = h->dr->totalNum;
+        diffResult_t rest = *h->dr;
+        rest.offsets = malloc(sizeof(int32_t) * (totalNum > 0 ? totalNum : 1));
+        memcpy(rest.offsets, h->dr->offsets, sizeof(int32_t) * totalNum);
+        int32_t *seedOffsets = malloc(sizeof(int32_t) * (totalNum > 0 ? totalNum : 1));
+        int32_t missNum = 0;
+        for(int32_t i=0; i<totalNum; ++i) {
+            if(rest.offsets[i] == -1) missNum++;
+        }
+        for(uint32_t s=0; s<bh->seedNum && missNum > 0; ++s) {
+            const char *seed = bh->seeds[s];
+            if(0 == strcmp(seed, srcFullName) || 0 == strcmp(seed, dstFullName)) continue;
+            if(0 == Diff_seed(seed, h->fd, &rest, seedOffsets)) continue;
+            for(int32_t i=0; i<totalNum; ++i) {
+                if(seedOffsets[i] < 0) continue;
+                if(!h->borrow) {
+                    h->borrow = malloc(sizeof(helperBorrow_t) * totalNum);
+                }
+                helperBorrow_t *b = &h->borrow[h->borrowNum++];
+                b->owner = NULL;
+                b->seed = seed;
+                b->offset = seedOffsets[i];
+                b->seq = i;
+                rest.offsets[i] = -2;
+                missNum--;
+            }
+        }
+        free(seedOffsets);
+        free(rest.offsets);
+        h->cacheSize = (h->dr->matchNum + h->dr->cacheNum + h->borrowNum) * h->fd->blockSize;
+        LOGI("%s found %u blocks in seeds, still miss %d\n", h->fileName, h->borrowNum, missNum);
+    } while(0);
+
+    free(srcFullName);
+    free(digestString);
+    free(dstFullName);
+    free(url);
+    free(digestUrl);
+}
+
 static CRScode perform_diffloop(bulkHelper_t *bh) {
     LOGI("begin\n");
     if(!bh) {
@@ -372,19 +730,9 @@ static CRScode perform_diffloop(bulkHelper_t *bh) {
         return code;
     }
 
+    perform_bulklist(bh, m);
+    bulkSeed_list(bh);
     helper_t **bulk = &bh->currentBulk;
-    if(!*bulk) {
-        sum_t *melt = NULL;
-        LL_FOREACH(m->file, melt) {
-            helper_t *h = helper_malloc();
-            h->fileDir = bh->fileDir;
-            h->baseUrl = bh->baseUrl;
-            h->fileName = strdup(melt->name);
-            h->fileSize = melt->size;
-            memcpy(h->fileDigest, melt->digest, CRS_STRONG_DIGEST_SIZE);
-            LL_APPEND(*bulk, h);
-        }
-    }
 
     helper_t *elt=NULL;
     LL_FOREACH(*bulk,elt) {
@@ -392,6 +740,7 @@ static CRScode perform_diffloop(bulkHelper_t *bh) {
         if(elt->isComplete == 0) {
             code = helper_perform_diff(elt);
             if(code != CRS_OK) break;
+            bulkSeed_diff(bh, elt);
             crs_callback_diff(elt->fileName, elt->cacheSize, elt->isComplete);
         }
     }
@@ -407,12 +756,85 @@ CRScode bulkHelper_perform_diff(bulkHelper_t *bh) {
         return CRS_PARAM_ERROR;
     }
     CRScode code = CRS_OK;
+    //local files hashed by last run or diff are not read again
+    if(bh->fileDir) Digest_cacheLoad(bh->fileDir);
     code = perform_diffloop(bh);
+    Digest_cacheSave();
 
     LOGI("end %d\n", code);
     return code;
 }
 
+//missing block of the whole bulk, downloaded by owner only
+typedef struct bulkBlock_t {
+    uint8_t         strong[CRS_STRONG_DIGEST_SIZE]; //key
+    helper_t        *owner; //first file missing it
+    size_t          offset; //in owner
+    uint32_t        blockSize;
+    UT_hash_handle  hh;
+} bulkBlock_t;
+
+//index h's missing blocks, the ones an earlier indexed file owns become h's borrow,
+//blocks borrowed from seeds are kept and not missing
+static void bulkPlan_add(bulkBlock_t **index, helper_t *h) {
+    uint32_t seedNum = 0;
+    while(seedNum < h->borrowNum && !h->borrow[seedNum].owner) seedNum++;
+    h->borrowNum = seedNum;
+    if(h->isComplete || !h->fd || !h->dr) return;
+    patchOption_t opt;
+    Patch_getOption(&opt);
+    if(opt.inplace) return; //in place patch downloads its own blocks
+
+    uint8_t *seeded = calloc(h->dr->totalNum + 1, 1);
+    for(uint32_t k=0; k<seedNum; ++k) {
+        seeded[h->borrow[k].seq] = 1;
+    }
+    bulkBlock_t *item = NULL;
+    for(int32_t i=0; i<h->dr->totalNum; ++i) {
+        if(h->dr->offsets[i] != -1 || seeded[i]) continue;
+        const uint8_t *strong = h->fd->blockDigest[i].strong;
+        HASH_FIND(hh, *index, strong, CRS_STRONG_DIGEST_SIZE, item);
+        if(!item) {
+            item = calloc(1, sizeof(bulkBlock_t));
+            memcpy(item->strong, strong, CRS_STRONG_DIGEST_SIZE);
+            item->owner = h;
+            item->offset = (size_t)i * h->fd->blockSize;
+            item->blockSize = h->fd->blockSize;
+            HASH_ADD(hh, *index, strong, CRS_STRONG_DIGEST_SIZE, item);
+        } else if(item->owner != h && item->blockSize == h->fd->blockSize) {
+            if(!h->borrow) {
+                h->borrow = malloc(sizeof(helperBorrow_t) * h->dr->totalNum);
+            }
+            helperBorrow_t *b = &h->borrow[h->borrowNum++];
+            b->owner = item->owner;
+            b->seed = NULL;
+            b->offset = item->offset;
+            b->seq = i;
+        }
+    }
+    free(seeded);
+    if(h->borrowNum > seedNum) {
+        LOGI("%s borrows %u blocks from other files\n", h->fileName, h->borrowNum - seedNum);
+    }
+}
+
+static void bulkPlan_free(bulkBlock_t **index) {
+    bulkBlock_t *item = NULL, *tmp = NULL;
+    HASH_ITER(hh, *index, item, tmp) {
+        HASH_DEL(*index, item);
+        free(item);
+    }
+}
+
+//every owner of h's borrow blocks patched
+static int bulkPlan_ready(const helper_t *h) {
+    for(uint32_t k=0; k<h->borrowNum; ++k) {
+        if(!h->borrow[k].owner || (k > 0 && h->borrow[k].owner == h->borrow[k-1].owner)) continue;
+        if(!h->borrow[k].owner->isComplete) return 0;
+    }
+    return 1;
+}
+
 CRScode bulkHelper_perform_patch(bulkHelper_t *bh) {
     LOGI("begin\n");
     if(!bh) {
@@ -427,14 +849,193 @@ CRScode bulkHelper_perform_patch(bulkHelper_t *bh) {
         return CRS_PARAM_ERROR;
     }
 
+    //owners come first in list, patched before files borrowing from them
+    bulkBlock_t *index = NULL;
     helper_t *elt=NULL;
+    LL_FOREACH(bulk,elt) {
+        bulkPlan_add(&index, elt);
+    }
+    LOGI("bulk distinct missing blocks Num = %u\n", HASH_COUNT(index));
+    bulkPlan_free(&index);
+
+    if(bh->fileDir) Digest_cacheLoad(bh->fileDir);
     LL_FOREACH(bulk,elt) {
         if(elt->isComplete == 0) {
             code = helper_perform_patch(elt);
             if(code != CRS_OK) break;
         }
     }
+    if(code == CRS_OK) {
+        bulkInstalled_commit(bh);
+    }
+    Digest_cacheSave();
+
+    LOGI("end %d\n", code);
+    return code;
+}
+
+//shared by pipeline threads, guarded by lock
+typedef struct bulkPipe_t {
+    const bulkHelper_t *bh;
+    helper_t **files;
+    uint32_t fileNum;
+    uint32_t nextDiff; //files[0, nextDiff) taken by diff
+    uint32_t *ready; //queue of diffed files, FIFO
+    uint32_t readyHead;
+    uint32_t readyTail;
+    size_t *memory; //each queued file's fd and dr Bytes
+    size_t queued; //sum of queued files' memory
+    uint32_t diffing;
+    uint32_t patching;
+    bulkBlock_t *index; //missing blocks of diffed files
+    CRScode code; //first error stops taking new work
+    omp_lock_t lock;
+} bulkPipe_t;
+
+enum BULKjob {
+    BULK_EXIT = -1,
+    BULK_WAIT = 0,
+    BULK_DIFF,
+    BULK_PATCH,
+};
+
+//take first queued file whose borrow owners patched, FIFO kept for the rest
+static int bulkPipe_ready(bulkPipe_t *p, uint32_t *idx) {
+    for(uint32_t k=p->readyHead; k<p->readyTail; ++k) {
+        if(!bulkPlan_ready(p->files[p->ready[k]])) continue;
+        *idx = p->ready[k];
+        memmove(p->ready + p->readyHead + 1, p->ready + p->readyHead, sizeof(uint32_t) * (k - p->readyHead));
+        p->readyHead++;
+        return 1;
+    }
+    return 0;
+}
+
+//patch first to free memory, then diff ahead within limits
+static int bulkPipe_take(bulkPipe_t *p, uint32_t diffThreads, uint32_t patchThreads, uint32_t *idx) {
+    int job = BULK_WAIT;
+    omp_set_lock(&p->lock);
+    if(p->code != CRS_OK) {
+        job = BULK_EXIT;
+    } else if(p->readyHead < p->readyTail && p->patching < patchThreads &&
+              bulkPipe_ready(p, idx)) {
+        p->patching++;
+        job = BULK_PATCH;
+    } else if(p->nextDiff < p->fileNum && p->diffing < diffThreads &&
+              (p->queued < s_bulkOption.memoryLimit || p->readyHead == p->readyTail)) {
+        *idx = p->nextDiff++;
+        p->diffing++;
+        job = BULK_DIFF;
+    } else if(p->nextDiff >= p->fileNum && p->diffing == 0 && p->readyHead == p->readyTail) {
+        job = BULK_EXIT; //running patches finished by their own threads
+    }
+    omp_unset_lock(&p->lock);
+    return job;
+}
+
+static void bulkPipe_diff(bulkPipe_t *p, uint32_t idx) {
+    helper_t *h = p->files[idx];
+    CRScode code = helper_perform_diff(h);
+    if(code == CRS_OK) {
+        bulkSeed_diff(p->bh, h);
+        crs_callback_diff(h->fileName, h->cacheSize, h->isComplete);
+    }
+    size_t memory = 0;
+    if(h->fd && h->dr) {
+        memory = (size_t)h->dr->totalNum * (sizeof(digest_t) + sizeof(int32_t)) + h->fd->blockSize;
+    }
+    omp_set_lock(&p->lock);
+    p->diffing--;
+    if(code != CRS_OK) {
+        if(p->code == CRS_OK) p->code = code;
+    } else if(h->isComplete == 0) {
+        //owners queued before the files borrowing from them
+        bulkPlan_add(&p->index, h);
+        memory += sizeof(helperBorrow_t) * h->borrowNum;
+        p->memory[idx] = memory;
+        p->queued += memory;
+        p->ready[p->readyTail++] = idx;
+    }
+    omp_unset_lock(&p->lock);
+}
+
+static void bulkPipe_patch(bulkPipe_t *p, uint32_t idx) {
+    CRScode code = helper_perform_patch(p->files[idx]);
+    omp_set_lock(&p->lock);
+    p->patching--;
+    p->queued -= p->memory[idx];
+    if(code != CRS_OK && p->code == CRS_OK) {
+        p->code = code;
+    }
+    omp_unset_lock(&p->lock);
+}
 
+CRScode bulkHelper_perform_update(bulkHelper_t *bh) {
+    LOGI("begin\n");
+    if(!bh) {
+        LOGE("end %d\n", CRS_PARAM_ERROR);
+        return CRS_PARAM_ERROR;
+    }
+    if(!bh->currentMagnet) {
+        LOGI("end magnet miss\n");
+        return CRS_OK;
+    }
+    perform_bulklist(bh, bh->currentMagnet);
+    bulkSeed_list(bh);
+    if(bh->fileDir) Digest_cacheLoad(bh->fileDir);
+
+    bulkPipe_t p;
+    memset(&p, 0, sizeof(p));
+    p.bh = bh;
+    helper_t *elt = NULL;
+    LL_COUNT(bh->currentBulk, elt, p.fileNum);
+    p.files = malloc(sizeof(helper_t*) * (p.fileNum + 1));
+    p.ready = malloc(sizeof(uint32_t) * (p.fileNum + 1));
+    p.memory = calloc(p.fileNum + 1, sizeof(size_t));
+    p.fileNum = 0;
+    LL_FOREACH(bh->currentBulk, elt) {
+        if(elt->isComplete == 0) {
+            p.files[p.fileNum++] = elt;
+        }
+    }
+    p.code = CRS_OK;
+    omp_init_lock(&p.lock);
+
+    uint32_t diffThreads = (s_bulkOption.diffThreads > 0) ? s_bulkOption.diffThreads : (uint32_t)omp_get_num_procs();
+    uint32_t patchThreads = (s_bulkOption.patchThreads > 0) ? s_bulkOption.patchThreads : 1;
+    LOGI("files %u diffThreads %u patchThreads %u\n", p.fileNum, diffThreads, patchThreads);
+
+    //every thread takes any job, so fewer threads than asked still finish all
+#pragma omp parallel num_threads(diffThreads + patchThreads)
+    {
+        uint32_t idx = 0;
+        int job = BULK_WAIT;
+        while((job = bulkPipe_take(&p, diffThreads, patchThreads, &idx)) != BULK_EXIT) {
+            switch(job) {
+            case BULK_DIFF:
+                bulkPipe_diff(&p, idx);
+                break;
+            case BULK_PATCH:
+                bulkPipe_patch(&p, idx);
+                break;
+            default:
+                Util_msleep(10);
+                break;
+            }
+        }
+    }
+
+    CRScode code = p.code;
+    if(code == CRS_OK) {
+        bulkInstalled_commit(bh);
+    }
+    Digest_cacheSave();
+    LOGI("bulk distinct missing blocks Num = %u\n", HASH_COUNT(p.index));
+    bulkPlan_free(&p.index);
+    omp_destroy_lock(&p.lock);
+    free(p.files);
+    free(p.ready);
+    free(p.memory);
     LOGI("end %d\n", code);
     return code;
 }
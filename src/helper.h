@@ -36,13 +36,24 @@ extern "C" {
 
 CRScode helper_perform_version();
 
+struct helper_t;
+
+//missing block another bulk file downloads, copied from it once that one patched,
+//or found in a seed, another local file
+typedef struct helperBorrow_t {
+    struct helper_t *owner; //NULL if from seed
+    const char *seed; //ref to bulkHelper_t.seeds
+    size_t offset; //block offset in owner or seed
+    int32_t seq; //block index in this file
+} helperBorrow_t;
+
 typedef struct helper_t {
     //here is constant ref pointer, never change
     char *fileDir; //file directory, end with '/', ref to bulkhelper_t.fileDir
     char *baseUrl; //base url, end with '/', ref to bulkhelper_t.baseUrl
 
     //here is constant, never change
-    char *fileName; //file name
+    char *fileName; //file name, bulk ones ref to bulkHelper_t.currentMagnet
     uint32_t fileSize; //whole file size
     uint8_t fileDigest[CRS_STRONG_DIGEST_SIZE]; //whole file digest
     struct helper_t *next; //used by bulkhelper with utlist(single-link)
@@ -53,6 +64,8 @@ typedef struct helper_t {
     int isComplete; //0 not; 1 complete
     fileDigest_t *fd;
     diffResult_t *dr;
+    helperBorrow_t *borrow; //set by bulk planner
+    uint32_t borrowNum;
 
 } helper_t;
 
@@ -71,6 +84,8 @@ typedef struct bulkHelper_t {
     //here is bulk file struct
     magnet_t *currentMagnet; //currVersion's magnet
     helper_t *currentBulk; //used with utlist(signle-link)
+    char **seeds; //local files of fileDir, full path
+    uint32_t seedNum;
 
 } bulkHelper_t;
 
@@ -82,8 +97,24 @@ CRScode bulkHelper_set_magnet       (bulkHelper_t *bh, const char *magnetString)
 
 CRScode bulkHelper_perform_diff     (bulkHelper_t *bh);
 
+//missing blocks same in several files downloaded by the first one only, copied by others
 CRScode bulkHelper_perform_patch    (bulkHelper_t *bh);
 
+//limits of bulkHelper_perform_update
+typedef struct bulkOption_t {
+    uint32_t diffThreads; //files diffing at once, 0 means cpu count
+    uint32_t patchThreads; //files downloading at once, share patchOption_t.connections
+    uint32_t memoryLimit; //digests and diff results waiting for patch, Bytes
+    uint32_t seeds; //1 diff new or changed files against every other local file in fileDir too
+    uint32_t delta; //1 only files added or changed since the installed magnet are diffed, dropped ones removed
+} bulkOption_t;
+
+void bulkHelper_getOption(bulkOption_t *opt);
+void bulkHelper_setOption(const bulkOption_t *opt);
+
+//diff and patch as a pipeline, one file diffed while others downloading, same blocks shared as above
+CRScode bulkHelper_perform_update   (bulkHelper_t *bh);
+
 #if defined __cplusplus
 }
 #endif
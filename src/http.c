@@ -23,6 +23,7 @@ SOFTWARE.
 */
 #include <sys/stat.h>
 #include <string.h>
+#include <omp.h>
 #ifdef _MSC_VER
 #   include "win/libgen.h"
 #else
@@ -33,15 +34,132 @@ SOFTWARE.
 #include "util.h"
 #include "log.h"
 
+#define HTTP_POOL_SIZE 16
+
+//long-lived handles, share dns/connection/cookie between all requests
+typedef struct httpSession_t {
+    CURLSH      *share;
+    CURL        *easy[HTTP_POOL_SIZE]; //idle easy handles, keep their connections alive
+    int         easyNum;
+    CURLM       *multi[HTTP_POOL_SIZE]; //idle multi handles, keep their connections alive
+    int         multiNum;
+    omp_lock_t  poolLock; //also guard link
+    omp_lock_t  shareLock[CURL_LOCK_DATA_LAST];
+    httpLink_t  link;
+    char        **mirrorBase; //pairs of base and mirror, also guarded by poolLock
+    char        **mirror;
+    uint32_t    mirrorNum;
+} httpSession_t;
+
+static httpSession_t *s_session = NULL;
+
+static void HTTP_share_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *userp) {
+    (void)curl;
+    (void)access;
+    httpSession_t *s = (httpSession_t*)userp;
+    omp_set_lock(&s->shareLock[data]);
+}
+
+static void HTTP_share_unlock(CURL *curl, curl_lock_data data, void *userp) {
+    (void)curl;
+    httpSession_t *s = (httpSession_t*)userp;
+    omp_unset_lock(&s->shareLock[data]);
+}
+
+static httpSession_t* httpSession_malloc() {
+    httpSession_t *s = calloc(1, sizeof(httpSession_t));
+    omp_init_lock(&s->poolLock);
+    for(int i=0; i<CURL_LOCK_DATA_LAST; ++i) {
+        omp_init_lock(&s->shareLock[i]);
+    }
+    s->share = curl_share_init();
+    if(s->share) {
+        curl_share_setopt(s->share, CURLSHOPT_LOCKFUNC, HTTP_share_lock);
+        curl_share_setopt(s->share, CURLSHOPT_UNLOCKFUNC, HTTP_share_unlock);
+        curl_share_setopt(s->share, CURLSHOPT_USERDATA, (void*)s);
+        curl_share_setopt(s->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(s->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
+        curl_share_setopt(s->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+        curl_share_setopt(s->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+    }
+    return s;
+}
+
+static void httpSession_free(httpSession_t *s) {
+    if(s) {
+        for(int i=0; i<s->multiNum; ++i) {
+            curl_multi_cleanup(s->multi[i]);
+        }
+        for(int i=0; i<s->easyNum; ++i) {
+            curl_easy_cleanup(s->easy[i]);
+        }
+        if(s->share) {
+            curl_share_cleanup(s->share);
+        }
+        for(uint32_t i=0; i<s->mirrorNum; ++i) {
+            free(s->mirrorBase[i]);
+            free(s->mirror[i]);
+        }
+        free(s->mirrorBase);
+        free(s->mirror);
+        omp_destroy_lock(&s->poolLock);
+        for(int i=0; i<CURL_LOCK_DATA_LAST; ++i) {
+            omp_destroy_lock(&s->shareLock[i]);
+        }
+        free(s);
+    }
+}
+
 CRScode HTTP_global_init() {
     CURLcode code = curl_global_init(CURL_GLOBAL_DEFAULT);
+    if(code == CURLE_OK && !s_session) {
+        s_session = httpSession_malloc();
+    }
     return (code == CURLE_OK) ? CRS_OK : CRS_INIT_ERROR;
 }
 
 void HTTP_global_cleanup() {
+    httpSession_free(s_session);
+    s_session = NULL;
     curl_global_cleanup();
 }
 
+CURL* HTTP_easy_acquire() {
+    CURL *curl = NULL;
+    if(s_session) {
+        omp_set_lock(&s_session->poolLock);
+        if(s_session->easyNum > 0) {
+            curl = s_session->easy[--s_session->easyNum];
+        }
+        omp_unset_lock(&s_session->poolLock);
+    }
+    if(!curl) {
+        curl = curl_easy_init();
+    }
+    if(curl && s_session && s_session->share) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, s_session->share);
+    }
+    return curl;
+}
+
+void HTTP_easy_release(CURL *curl) {
+    if(!curl) return;
+    curl_easy_reset(curl); //options only, connections and caches still alive
+    if(s_session) {
+        omp_set_lock(&s_session->poolLock);
+        if(s_session->easyNum < HTTP_POOL_SIZE) {
+            s_session->easy[s_session->easyNum++] = curl;
+            curl = NULL;
+        }
+        omp_unset_lock(&s_session->poolLock);
+    }
+    if(curl) {
+        curl_easy_cleanup(curl);
+    }
+}
+
 #if 0
 static const char s_infotype[CURLINFO_END][3] = {"* ", "< ", "> ", "{ ", "} ", "{ ", "} " };
 static int HTTP_curl_debug(CURL *curl, curl_infotype type, char *data, size_t size, void *userptr) {
@@ -72,53 +190,337 @@ static void HTTP_curl_setopt(CURL *curl) {
     curl_easy_setopt(curl, CURLOPT_AUTOREFERER, 1L); /* allow auto referer */
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L); /* allow follow location */
     curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 5L); /* allow redir 5 times */
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L); /* connection timeout */
+    httpLink_t link;
+    HTTP_getLink(&link);
+    long connectTimeout = 10L;
+    if(link.rtt > 0) { //3s plus 10 round trips, no more than 30s
+        connectTimeout = 3L + link.rtt / 100;
+        if(connectTimeout > 30L) connectTimeout = 30L;
+    }
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, connectTimeout); /* connection timeout */
+    //fixed floor catches dead links only, measured bandwidth is a best case and a slower link still works
     curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 10240L); /* used for check bad network timeout */
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 30L);
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS); /* http2 if server allow */
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L); /* prefer multiplex than new connection */
+#endif
     /*Do not setup CURLOPT_TIMEOUT, since range and file download may cost lots of time*/
     /*curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);*/
 }
 
-static const char *response200 = "HTTP/1.0 200 OK";
-static const char *response200_1 = "HTTP/1.1 200 OK";
-static const size_t responselen = 15; //as above strlen
-
 #ifdef _MSC_VER
 #   define strcasecmp _stricmp
 #   define strncasecmp _strnicmp
 #endif
 
+typedef enum {
+    RANGE_SINGLE = 0, //206 with one Content-Range
+    RANGE_BOUNDARY, //multipart, wait for boundary line
+    RANGE_PARTHEADER, //multipart, part headers
+    RANGE_PARTDATA, //multipart, part body
+    RANGE_END, //multipart, close boundary
+} RANGEstate;
+
+static const char *header_contentRange = "Content-Range:";
+static const char *header_contentType = "Content-Type:";
+static const char *header_etag = "ETag:";
+static const char *header_lastModified = "Last-Modified:";
+static const char *multipart = "multipart/byteranges";
+
+//part must begin at a requested range's start and end at one's end, since servers may merge ranges
+static int Range_check(httpRange_t *hr, unsigned long from, unsigned long to, unsigned long total) {
+    if(hr->total > 0 && total > 0 && total != hr->total) {
+        LOGE("Content-Range total %lu, expected %lu\n", total, (unsigned long)hr->total);
+        hr->mismatch = 1;
+        return -1;
+    }
+    if(!hr->ranges) return 0;
+    int start = 0, end = 0;
+    const char *p = hr->ranges;
+    while(*p) {
+        char *next = NULL;
+        unsigned long a = strtoul(p, &next, 10);
+        if(*next != '-') break;
+        unsigned long b = strtoul(next + 1, &next, 10);
+        if(a == from) start = 1;
+        if(b == to) end = 1;
+        p = (*next == ',') ? next + 1 : next;
+        if(*next != ',') break;
+    }
+    if(!start || !end) {
+        LOGE("Content-Range %lu-%lu not requested %s\n", from, to, hr->ranges);
+        hr->mismatch = 1;
+        return -1;
+    }
+    return 0;
+}
+
+//"Content-Range: bytes a-b/total", total may be "*"
+static int Range_parse(httpRange_t *hr, const char *value, size_t *offset, size_t *len) {
+    unsigned long from = 0, to = 0, total = 0;
+    while(*value == ' ') value++;
+    if(2 > sscanf(value, "bytes %lu-%lu/%lu", &from, &to, &total) || to < from) {
+        return -1;
+    }
+    if(0 != Range_check(hr, from, to, total)) {
+        return -1;
+    }
+    *offset = from;
+    *len = to - from + 1;
+    return 0;
+}
+
+//take first response's validator, later responses must carry the same
+static int Range_validator(httpRange_t *hr, const char *value, int isETag) {
+    if(!hr->validator || hr->status < 200 || hr->status >= 300) return 0; //not of redirects
+    while(*value == ' ') value++;
+    char v[HTTP_VALIDATOR_SIZE];
+    size_t len = strcspn(value, "\r\n");
+    if(len >= sizeof(v)) len = sizeof(v) - 1;
+    memcpy(v, value, len);
+    v[len] = '\0';
+    if(isETag && 0 == strncmp(v, "W/", 2)) {
+        return 0; //weak ETag not allowed in If-Range
+    }
+    int wasETag = (hr->validator[0] == '"');
+    if(hr->validator[0] == '\0' || (hr->captured && isETag && !wasETag)) {
+        //prefer ETag to Last-Modified of same response
+        memcpy(hr->validator, v, len + 1);
+        hr->captured = 1;
+    } else if(!hr->captured && isETag == wasETag && 0 != strcmp(v, hr->validator)) {
+        LOGE("remote file changed, %s now %s\n", hr->validator, v);
+        hr->changed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static void Range_boundary(httpRange_t *hr, const char *value) {
+    const char *b = strstr(value, "boundary=");
+    if(!b) return;
+    b += strlen("boundary=");
+    if(*b == '"') b++;
+    size_t i = 2;
+    hr->boundary[0] = '-';
+    hr->boundary[1] = '-';
+    while(*b && *b != '"' && *b != ';' && *b != '\r' && *b != '\n' && i < sizeof(hr->boundary) - 1) {
+        hr->boundary[i++] = *b++;
+    }
+    hr->boundary[i] = '\0';
+}
+
 static size_t header_callback(void *data, size_t size, size_t nmemb, void *userp)
 {
-    (void)userp;
+    httpRange_t *hr = (httpRange_t*)userp;
+    size_t realSize = size * nmemb;
+    char line[256];
+    size_t lineLen = realSize < sizeof(line) - 1 ? realSize : sizeof(line) - 1;
+    memcpy(line, data, lineLen);
+    line[lineLen] = '\0';
+
+    if(0 == strncasecmp(line, "HTTP/", 5)) {
+        //new response (maybe after redirect), reset parser
+        hr->status = 0;
+        sscanf(line, "HTTP/%*s %ld", &hr->status);
+        hr->state = RANGE_SINGLE;
+        hr->boundary[0] = '\0';
+        if(hr->status == 200) {
+            //aborted by first body data, headers go on to tell if file changed
+            LOGE("range response 200\n");
+            hr->isWhole = 1;
+        }
+    } else if(0 == strncasecmp(line, header_contentRange, strlen(header_contentRange))) {
+        if(0 != Range_parse(hr, line + strlen(header_contentRange), &hr->offset, &hr->remain)) {
+            LOGE("%s", line);
+            return 0;
+        }
+    } else if(0 == strncasecmp(line, header_etag, strlen(header_etag))) {
+        if(0 != Range_validator(hr, line + strlen(header_etag), 1)) {
+            return 0;
+        }
+    } else if(0 == strncasecmp(line, header_lastModified, strlen(header_lastModified))) {
+        if(0 != Range_validator(hr, line + strlen(header_lastModified), 0)) {
+            return 0;
+        }
+    } else if(0 == strncasecmp(line, header_contentType, strlen(header_contentType))) {
+        if(strstr(line, multipart)) {
+            Range_boundary(hr, line);
+            hr->state = RANGE_BOUNDARY;
+            hr->lineLen = 0;
+        }
+    }
+    return realSize;
+}
+
+static int Range_line(httpRange_t *hr) {
+    char *line = hr->line;
+    size_t len = hr->lineLen;
+    hr->lineLen = 0;
+    if(len > 0 && line[len-1] == '\r') len--;
+    line[len] = '\0';
+
+    if(hr->state == RANGE_BOUNDARY) {
+        size_t blen = strlen(hr->boundary);
+        if(blen > 2 && 0 == strncmp(line, hr->boundary, blen)) {
+            hr->state = (0 == strncmp(line + blen, "--", 2)) ? RANGE_END : RANGE_PARTHEADER;
+            hr->remain = 0;
+        }
+    } else if(hr->state == RANGE_PARTHEADER) {
+        if(len == 0) {
+            if(hr->remain == 0) {
+                LOGE("multipart part without Content-Range\n");
+                return -1;
+            }
+            hr->state = RANGE_PARTDATA;
+        } else if(0 == strncasecmp(line, header_contentRange, strlen(header_contentRange))) {
+            if(0 != Range_parse(hr, line + strlen(header_contentRange), &hr->offset, &hr->remain)) {
+                LOGE("%s\n", line);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static size_t Range_callback(void *data, size_t size, size_t nmemb, void *userp) {
+    httpRange_t *hr = (httpRange_t*)userp;
     size_t realSize = size * nmemb;
-    size_t minSize = realSize < responselen ? realSize : responselen;
-    if( 0 == strncasecmp((const char*)data, response200, minSize) ||
-        0 == strncasecmp((const char*)data, response200_1, minSize) ) {
-        LOGE("range response 200\n");
-        return 0;
+    const char *p = (const char*)data;
+    size_t left = realSize;
+
+    if(hr->state == RANGE_SINGLE) {
+        if(hr->status != 206) {
+            LOGE("range response %ld\n", hr->status);
+            return 0;
+        }
+        if(realSize != hr->callback(hr->offset, p, realSize, hr->data)) {
+            return 0;
+        }
+        hr->offset += realSize;
+        return realSize;
+    }
+
+    while(left > 0) {
+        if(hr->state == RANGE_PARTDATA) {
+            size_t n = left < hr->remain ? left : hr->remain;
+            if(n != hr->callback(hr->offset, p, n, hr->data)) {
+                return 0;
+            }
+            hr->offset += n;
+            hr->remain -= n;
+            p += n;
+            left -= n;
+            if(hr->remain == 0) {
+                hr->state = RANGE_BOUNDARY;
+            }
+        } else if(hr->state == RANGE_END) {
+            break; //epilogue
+        } else {
+            char c = *p++;
+            left--;
+            if(c == '\n') {
+                if(0 != Range_line(hr)) {
+                    return 0;
+                }
+            } else if(hr->lineLen < sizeof(hr->line) - 1) {
+                hr->line[hr->lineLen++] = c;
+            }
+        }
     }
     return realSize;
 }
 
-CURLcode HTTP_Range(CURL *curl, const char *url, const char *range, void *callback, void *data) {
+void HTTP_Range_setopt(CURL *curl, const char *url, const char *ranges, httpRange_t *hr) {
+    hr->status = 0;
+    hr->isWhole = 0;
+    hr->state = RANGE_SINGLE;
+    hr->offset = strtoul(ranges, NULL, 10); //206 without Content-Range
+    hr->remain = 0;
+    hr->boundary[0] = '\0';
+    hr->lineLen = 0;
+    hr->ranges = ranges;
+    hr->changed = 0;
+    hr->mismatch = 0;
+    hr->captured = 0;
+    curl_slist_free_all(hr->headers);
+    hr->headers = NULL;
+
     HTTP_curl_setopt(curl);
+    if(hr->validator && hr->validator[0] != '\0') {
+        char header[HTTP_VALIDATOR_SIZE + 16];
+        snprintf(header, sizeof(header), "If-Range: %s", hr->validator);
+        hr->headers = curl_slist_append(NULL, header);
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, hr->headers);
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
     curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, (void*)header_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, data);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void*)hr);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, (void*)Range_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)hr);
     curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
-    curl_easy_setopt(curl, CURLOPT_RANGE, range);
+    curl_easy_setopt(curl, CURLOPT_RANGE, ranges);
+}
+
+CURLcode HTTP_Range(CURL *curl, const char *url, const char *ranges, httpRange_t *hr) {
+    HTTP_Range_setopt(curl, url, ranges, hr);
 
     CURLcode curlcode = curl_easy_perform(curl);
     if(CURLE_OK != curlcode) {
         LOGI("curlcode %d\n", curlcode);
+    } else {
+        HTTP_measure(curl);
     }
-
-    curl_easy_reset(curl);
+    HTTP_Range_cleanup(hr);
     return curlcode;
 }
 
+void HTTP_Range_cleanup(httpRange_t *hr) {
+    if(!hr) return;
+    curl_slist_free_all(hr->headers);
+    hr->headers = NULL;
+    hr->ranges = NULL;
+}
+
+CURLM* HTTP_multi_acquire(long connections) {
+    CURLM *multi = NULL;
+    if(s_session) {
+        omp_set_lock(&s_session->poolLock);
+        if(s_session->multiNum > 0) {
+            multi = s_session->multi[--s_session->multiNum];
+        }
+        omp_unset_lock(&s_session->poolLock);
+    }
+    if(!multi) {
+        multi = curl_multi_init();
+    }
+    if(multi) {
+#ifdef CURLPIPE_MULTIPLEX
+        curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX); /* http2 multiplex if server allow */
+#endif
+#if LIBCURL_VERSION_NUM >= 0x071e00
+        curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, connections); /* keep-alive connections */
+#endif
+    }
+    return multi;
+}
+
+void HTTP_multi_release(CURLM *multi) {
+    if(!multi) return;
+    if(s_session) {
+        omp_set_lock(&s_session->poolLock);
+        if(s_session->multiNum < HTTP_POOL_SIZE) {
+            s_session->multi[s_session->multiNum++] = multi;
+            multi = NULL;
+        }
+        omp_unset_lock(&s_session->poolLock);
+    }
+    if(multi) {
+        curl_multi_cleanup(multi);
+    }
+}
+
 typedef struct filecache_t {
     const char *name;
     long bytes;
@@ -143,7 +545,7 @@ CRScode HTTP_File(const char *url, const char *filename, int retry, const char *
         return CRS_PARAM_ERROR;
     }
 
-    CURL *curl = curl_easy_init();
+    CURL *curl = HTTP_easy_acquire();
     if(!curl) {
         LOGE("%d\n", CRS_INIT_ERROR);
         return CRS_INIT_ERROR;
@@ -153,8 +555,13 @@ CRScode HTTP_File(const char *url, const char *filename, int retry, const char *
     filecache_t cache;
     cache.name = cbname;
 
+    char **urls = NULL;
+    uint32_t urlNum = HTTP_mirrorExpand(url, &urls);
+    uint32_t urlIdx = 0;
+
     struct stat st;
     while(retry-- >= 0) {
+        url = urls[urlIdx];
         if(0 == stat(filename, &st)) {
             cache.bytes = st.st_size;
         } else {
@@ -178,14 +585,20 @@ CRScode HTTP_File(const char *url, const char *filename, int retry, const char *
 
         CURLcode curlcode = curl_easy_perform(curl);
         fclose(f);
-        curl_easy_reset(curl);
+        if(curlcode == CURLE_OK) {
+            HTTP_measure(curl);
+        }
 
         switch(curlcode) {
         case CURLE_OK:
             code = CRS_OK;
             break;
         case CURLE_HTTP_RETURNED_ERROR: // server connect OK, remote file not exist
-            retry = -1;
+            if(urlIdx + 1 < urlNum) {
+                retry++; //mirror's fault, not counted
+            } else {
+                retry = -1;
+            }
             code = CRS_HTTP_ERROR;
             break;
         case CURLE_OPERATION_TIMEDOUT: //timeout, go on
@@ -201,9 +614,205 @@ CRScode HTTP_File(const char *url, const char *filename, int retry, const char *
             break;
         }
         LOGI("curlcode %d\n", curlcode);
+        if(urlIdx + 1 < urlNum) { //next mirror resumes same file
+            urlIdx++;
+        }
 
     }//end of while(retry)
-    curl_easy_cleanup(curl);
+    HTTP_easy_release(curl);
+    HTTP_mirrorFree(urls, urlNum);
 
     return code;
 }
+
+//smaller transfers are dominated by latency, no bandwidth sample
+#define HTTP_MEASURE_BYTES (64*1024)
+
+void HTTP_getLink(httpLink_t *link) {
+    if(!link) return;
+    memset(link, 0, sizeof(httpLink_t));
+    if(s_session) {
+        omp_set_lock(&s_session->poolLock);
+        *link = s_session->link;
+        omp_unset_lock(&s_session->poolLock);
+    }
+}
+
+void HTTP_measure(CURL *curl) {
+    if(!curl || !s_session) return;
+    double pre = 0, start = 0, total = 0, bytes = 0;
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME, &pre);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &start);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_off_t size = 0;
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &size);
+    bytes = (double)size;
+#else
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD, &bytes);
+#endif
+    uint32_t rtt = (start > pre) ? (uint32_t)((start - pre) * 1000) : 0;
+    uint32_t bandwidth = (bytes >= HTTP_MEASURE_BYTES && total > start) ? (uint32_t)(bytes / (total - start)) : 0;
+
+    omp_set_lock(&s_session->poolLock);
+    httpLink_t *link = &s_session->link;
+    //first sample as is, then moving average weighted 1/4
+    if(rtt > 0) {
+        link->rtt = (link->rtt == 0) ? rtt : (link->rtt * 3 + rtt) / 4;
+    }
+    if(bandwidth > 0) {
+        link->bandwidth = (link->bandwidth == 0) ? bandwidth : (uint32_t)(((uint64_t)link->bandwidth * 3 + bandwidth) / 4);
+    }
+    link->samples++;
+    omp_unset_lock(&s_session->poolLock);
+}
+
+typedef struct memcache_t {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} memcache_t;
+
+static size_t HTTP_writememory_func(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    memcache_t *mem = (memcache_t*)userdata;
+    size_t realSize = size * nmemb;
+    if(mem->size + realSize > mem->capacity) {
+        size_t capacity = (mem->capacity > 0) ? mem->capacity * 2 : 64 * 1024;
+        while(capacity < mem->size + realSize) capacity *= 2;
+        uint8_t *data = realloc(mem->data, capacity);
+        if(!data) return 0;
+        mem->data = data;
+        mem->capacity = capacity;
+    }
+    memcpy(mem->data + mem->size, ptr, realSize);
+    mem->size += realSize;
+    return realSize;
+}
+
+CRScode HTTP_Memory(const char *url, const char *cacheFilename, int retry, uint8_t **data, size_t *size) {
+    if(!url || !data || !size) {
+        LOGE("%d\n", CRS_PARAM_ERROR);
+        return CRS_PARAM_ERROR;
+    }
+
+    CURL *curl = HTTP_easy_acquire();
+    if(!curl) {
+        LOGE("%d\n", CRS_INIT_ERROR);
+        return CRS_INIT_ERROR;
+    }
+
+    CRScode code = CRS_OK;
+    memcache_t mem = {NULL, 0, 0};
+
+    char **urls = NULL;
+    uint32_t urlNum = HTTP_mirrorExpand(url, &urls);
+    uint32_t urlIdx = 0;
+
+    while(retry-- >= 0) {
+        size_t got = mem.size; //resume what got, a slow link may never finish in one go
+        HTTP_curl_setopt(curl);
+        curl_easy_setopt(curl, CURLOPT_URL, urls[urlIdx]);
+        curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, HTTP_writememory_func);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)&mem);
+        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+        curl_easy_setopt(curl, CURLOPT_RESUME_FROM, (long)mem.size);
+
+        CURLcode curlcode = curl_easy_perform(curl);
+        if(curlcode == CURLE_OK) {
+            HTTP_measure(curl);
+            code = CRS_OK;
+            break;
+        }
+        code = CRS_HTTP_ERROR;
+        LOGI("curlcode %d\n", curlcode);
+        if(urlIdx + 1 < urlNum) {
+            urlIdx++;
+            retry++; //mirror's fault, not counted
+        } else if(curlcode == CURLE_HTTP_RETURNED_ERROR) {
+            break; //remote file not exist
+        } else if(curlcode == CURLE_OPERATION_TIMEDOUT && mem.size > got) {
+            retry++; //timeout with progress, go on
+        } else if(curlcode == CURLE_RANGE_ERROR) {
+            mem.size = 0; //server can't resume, start again
+        }
+    }
+    HTTP_easy_release(curl);
+    HTTP_mirrorFree(urls, urlNum);
+
+    if(code == CRS_OK && cacheFilename) {
+        FILE *f = fopen(cacheFilename, "wb");
+        if(!f || mem.size != fwrite(mem.data, 1, mem.size, f)) {
+            LOGW("cache %s write fail\n", cacheFilename); //memory data still fine
+        }
+        if(f) fclose(f);
+    }
+    if(code == CRS_OK) {
+        *data = mem.data;
+        *size = mem.size;
+    } else {
+        free(mem.data);
+    }
+    return code;
+}
+
+CRScode HTTP_mirrorAdd(const char *base, const char *mirror) {
+    if(!base || !mirror || !s_session) {
+        return CRS_PARAM_ERROR;
+    }
+    omp_set_lock(&s_session->poolLock);
+    uint32_t n = s_session->mirrorNum;
+    s_session->mirrorBase = realloc(s_session->mirrorBase, sizeof(char*) * (n + 1));
+    s_session->mirror = realloc(s_session->mirror, sizeof(char*) * (n + 1));
+    s_session->mirrorBase[n] = strdup(base);
+    s_session->mirror[n] = strdup(mirror);
+    s_session->mirrorNum++;
+    omp_unset_lock(&s_session->poolLock);
+    return CRS_OK;
+}
+
+void HTTP_mirrorClear() {
+    if(!s_session) return;
+    omp_set_lock(&s_session->poolLock);
+    for(uint32_t i=0; i<s_session->mirrorNum; ++i) {
+        free(s_session->mirrorBase[i]);
+        free(s_session->mirror[i]);
+    }
+    free(s_session->mirrorBase);
+    free(s_session->mirror);
+    s_session->mirrorBase = NULL;
+    s_session->mirror = NULL;
+    s_session->mirrorNum = 0;
+    omp_unset_lock(&s_session->poolLock);
+}
+
+uint32_t HTTP_mirrorExpand(const char *url, char ***urls) {
+    uint32_t num = 0;
+    uint32_t mirrorNum = 0;
+    if(s_session) {
+        omp_set_lock(&s_session->poolLock);
+        mirrorNum = s_session->mirrorNum;
+    }
+    *urls = malloc(sizeof(char*) * (mirrorNum + 1));
+    (*urls)[num++] = strdup(url);
+    for(uint32_t i=0; i<mirrorNum; ++i) {
+        size_t baseLen = strlen(s_session->mirrorBase[i]);
+        if(0 != strncmp(url, s_session->mirrorBase[i], baseLen)) continue;
+        size_t len = strlen(s_session->mirror[i]) + strlen(url + baseLen) + 1;
+        char *u = malloc(len);
+        snprintf(u, len, "%s%s", s_session->mirror[i], url + baseLen);
+        (*urls)[num++] = u;
+    }
+    if(s_session) {
+        omp_unset_lock(&s_session->poolLock);
+    }
+    return num;
+}
+
+void HTTP_mirrorFree(char **urls, uint32_t num) {
+    if(!urls) return;
+    for(uint32_t i=0; i<num; ++i) {
+        free(urls[i]);
+    }
+    free(urls);
+}
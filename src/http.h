@@ -28,17 +28,84 @@ SOFTWARE.
 extern "C" {
 #endif
 
+#include <stdint.h>
+
 #include "global.h"
 #include "curl.h"
 
+//also create/free the shared session used by all requests below
 CRScode HTTP_global_init();
 void HTTP_global_cleanup();
 
-//callback should be int (Range_callback)(void *data, size_t size, size_t nmemb, void *userp);
-CURLcode HTTP_Range(CURL *curl, const char *url, const char *range, void *callback, void *data);
+//easy handle from session pool, keep-alive connections and shared dns/cookie
+CURL*   HTTP_easy_acquire();
+void    HTTP_easy_release(CURL *curl);
+
+//callback receive range data with its file offset, return size to go on, others to abort
+typedef size_t (*HTTP_range_callback)(size_t offset, const void *data, size_t size, void *userp);
+
+//strong ETag or Last-Modified of remote file
+#define HTTP_VALIDATOR_SIZE 128
+
+typedef struct httpRange_t {
+    HTTP_range_callback callback;
+    void    *data; //callback userp
+    //set by caller, zero to skip the check
+    char    *validator; //HTTP_VALIDATOR_SIZE buffer shared by one file's requests, sent as If-Range, "" captures response's
+    size_t  total; //expected file size in Content-Range
+    //result
+    long    status; //response status code
+    int     isWhole; //1 server ignored Range, response whole file with 200
+    int     changed; //1 remote file differs from validator, abort
+    int     mismatch; //1 Content-Range not as requested, abort
+    //single part or multipart/byteranges streaming parser
+    int     state;
+    size_t  offset; //current part's file offset
+    size_t  remain; //current part's rest length
+    char    boundary[80]; //"--" + boundary, RFC2046 max 70 chars
+    char    line[256]; //current header line
+    size_t  lineLen;
+    const char *ranges; //ref of requested ranges
+    int     captured; //1 validator taken from this response
+    struct curl_slist *headers; //If-Range
+} httpRange_t;
+
+//ranges "a-b" or "a-b,c-d,...", multi ranges may response multipart/byteranges
+CURLcode HTTP_Range(CURL *curl, const char *url, const char *ranges, httpRange_t *hr);
+//same as HTTP_Range without perform, used by curl multi interface,
+//ranges kept until request done, HTTP_Range_cleanup after last request
+void     HTTP_Range_setopt(CURL *curl, const char *url, const char *ranges, httpRange_t *hr);
+void     HTTP_Range_cleanup(httpRange_t *hr);
 
+//multi handle from session pool, http2 multiplex, no more than connections to one host
+CURLM*   HTTP_multi_acquire(long connections);
+void     HTTP_multi_release(CURLM *multi);
+
+//try url's mirrors in turn when one fails
 CRScode HTTP_File(const char *url, const char *filename, int retry, const char *cbname);
 
+//whole url into *data (malloc, caller free) without temp file,
+//also written to cacheFilename when not NULL, mirrors tried as HTTP_File
+CRScode HTTP_Memory(const char *url, const char *cacheFilename, int retry, uint8_t **data, size_t *size);
+
+//urls under base are also served as same path under mirror, base and mirror end with '/'
+CRScode  HTTP_mirrorAdd(const char *base, const char *mirror);
+void     HTTP_mirrorClear();
+//url itself first, then its mirrors, return urls count, free by HTTP_mirrorFree
+uint32_t HTTP_mirrorExpand(const char *url, char ***urls);
+void     HTTP_mirrorFree(char **urls, uint32_t num);
+
+//network measured by finished requests, smoothed, 0 means not measured yet
+typedef struct httpLink_t {
+    uint32_t rtt; //request to first response byte, ms
+    uint32_t bandwidth; //one connection's download speed, Bytes per second
+    uint32_t samples; //measured requests
+} httpLink_t;
+
+void HTTP_getLink(httpLink_t *link);
+//feed a finished request into link, called by HTTP_File, HTTP_Range and multi users
+void HTTP_measure(CURL *curl);
+
 #if defined __cplusplus
 }
 #endif
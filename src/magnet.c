@@ -23,38 +23,196 @@ SOFTWARE.
 */
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 
 #include "magnet.h"
-#include "utlist.h"
 #include "tpl.h"
 #include "util.h"
 #include "log.h"
 
 const char *MAGNET_EXT = ".fdi";
-static const char *MAGNET_TPL_FORMAT = "ssA(suc#)";
 
-sum_t* sum_malloc() {
-    return calloc(1, sizeof(sum_t));
-}
+static const char MAGNET_MAGIC[4] = {'C', 'R', 'S', 'M'};
+#define MAGNET_VERSION 1
+//format before the binary one, still read, and written for older clients
+static const char *MAGNET_TPL_FORMAT = "ssA(suc#)";
 
-void sum_free(sum_t *s) {
-    sum_t *elt, *tmp;
-    LL_FOREACH_SAFE(s,elt,tmp) {
-        LL_DELETE(s,elt);
-        free(elt->name);
-        free(elt);
-    }
-}
+//binary file header, followed by versions, padding to 4, file, index, names
+typedef struct magnetHeader_t {
+    char        magic[4];
+    uint32_t    version;
+    uint32_t    fileNum;
+    uint32_t    namesSize;
+    uint32_t    indexSize;
+    uint32_t    currSize; //with '\0'
+    uint32_t    nextSize; //with '\0'
+} magnetHeader_t;
 
 magnet_t* magnet_malloc() {
     return calloc(1, sizeof(magnet_t));
 }
 
-void magnet_free(magnet_t *m) {
-    if(m) {
+//drop files and versions, m reusable
+static void magnet_clear(magnet_t *m) {
+    if(m->map) {
+        Util_mapClose(m->map);
+    } else {
         free(m->currVersion);
         free(m->nextVersion);
-        sum_free(m->file);
+        free(m->file);
+        free(m->names);
+        free(m->index);
+    }
+    memset(m, 0, sizeof(magnet_t));
+}
+
+void magnet_free(magnet_t *m) {
+    if(m) {
+        magnet_clear(m);
+        free(m);
+    }
+}
+
+static uint32_t magnet_hash(const char *name, size_t len) {
+    uint32_t h = 2166136261u; //FNV-1a
+    for(size_t i=0; i<len; ++i) {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void magnet_addN(magnet_t *m, const char *name, size_t nameLen, uint32_t size, const uint8_t *digest) {
+    if(m->map) {
+        LOGE("loaded magnet is read only\n");
+        return;
+    }
+    if(m->fileNum == m->fileCap) {
+        m->fileCap = (m->fileCap > 0) ? m->fileCap * 2 : 64;
+        m->file = realloc(m->file, sizeof(sum_t) * m->fileCap);
+    }
+    while(m->namesSize + nameLen + 1 > m->namesCap) {
+        m->namesCap = (m->namesCap > 0) ? m->namesCap * 2 : 1024;
+        m->names = realloc(m->names, m->namesCap);
+    }
+    sum_t *s = &m->file[m->fileNum++];
+    s->nameOffset = m->namesSize;
+    s->size = size;
+    memcpy(s->digest, digest, CRS_STRONG_DIGEST_SIZE);
+    memcpy(m->names + m->namesSize, name, nameLen);
+    m->names[m->namesSize + nameLen] = '\0';
+    m->namesSize += nameLen + 1;
+    m->indexSize = 0; //stale until magnet_finish
+}
+
+void magnet_add(magnet_t *m, const char *name, uint32_t size, const uint8_t *digest) {
+    if(!m || !name || !digest) return;
+    magnet_addN(m, name, strlen(name), size, digest);
+}
+
+typedef struct magnetSort_t {
+    const char  *name;
+    uint32_t    idx;
+} magnetSort_t;
+
+static int magnetSort_cmp(const void *a, const void *b) {
+    const magnetSort_t *x = a, *y = b;
+    int c = strcmp(x->name, y->name);
+    return (c != 0) ? c : ((x->idx < y->idx) ? -1 : (x->idx > y->idx));
+}
+
+void magnet_finish(magnet_t *m) {
+    if(!m || m->map) return;
+    //files and names rewritten in name order, names packed
+    magnetSort_t *order = malloc(sizeof(magnetSort_t) * (m->fileNum + 1));
+    for(uint32_t i=0; i<m->fileNum; ++i) {
+        order[i].name = m->names + m->file[i].nameOffset;
+        order[i].idx = i;
+    }
+    qsort(order, m->fileNum, sizeof(magnetSort_t), magnetSort_cmp);
+    sum_t *file = malloc(sizeof(sum_t) * (m->fileNum + 1));
+    char *names = malloc(m->namesSize + 1);
+    uint32_t namesSize = 0;
+    for(uint32_t i=0; i<m->fileNum; ++i) {
+        size_t len = strlen(order[i].name) + 1;
+        file[i] = m->file[order[i].idx];
+        file[i].nameOffset = namesSize;
+        memcpy(names + namesSize, order[i].name, len);
+        namesSize += len;
+    }
+    free(order);
+    free(m->file);
+    free(m->names);
+    m->file = file;
+    m->fileCap = m->fileNum + 1;
+    m->names = names;
+    m->namesSize = namesSize;
+    m->namesCap = m->namesSize + 1;
+
+    //load factor at most 1/2
+    free(m->index);
+    m->indexSize = 8;
+    while(m->indexSize < m->fileNum * 2) m->indexSize *= 2;
+    m->index = calloc(m->indexSize, sizeof(uint32_t));
+    for(uint32_t i=0; i<m->fileNum; ++i) {
+        const char *name = m->names + m->file[i].nameOffset;
+        uint32_t slot = magnet_hash(name, strlen(name)) & (m->indexSize - 1);
+        while(m->index[slot] != 0) {
+            slot = (slot + 1) & (m->indexSize - 1);
+        }
+        m->index[slot] = i + 1;
+    }
+}
+
+const char* magnet_name(const magnet_t *m, const sum_t *s) {
+    return m->names + s->nameOffset;
+}
+
+const sum_t* magnet_find(const magnet_t *m, const char *name) {
+    if(!m || !name || m->indexSize == 0) return NULL;
+    uint32_t slot = magnet_hash(name, strlen(name)) & (m->indexSize - 1);
+    while(m->index[slot] != 0) {
+        const sum_t *s = &m->file[m->index[slot] - 1];
+        if(0 == strcmp(m->names + s->nameOffset, name)) {
+            return s;
+        }
+        slot = (slot + 1) & (m->indexSize - 1);
+    }
+    return NULL;
+}
+
+void magnet_delta(const magnet_t *from, const magnet_t *to, magnetDelta_t *delta) {
+    if(!delta) return;
+    memset(delta, 0, sizeof(magnetDelta_t));
+    uint32_t fromNum = from ? from->fileNum : 0;
+    uint32_t toNum = to ? to->fileNum : 0;
+    delta->added = malloc(sizeof(uint32_t) * (toNum + 1));
+    delta->changed = malloc(sizeof(uint32_t) * (toNum + 1));
+    delta->removed = malloc(sizeof(uint32_t) * (fromNum + 1));
+    uint32_t i = 0, j = 0;
+    while(i < fromNum || j < toNum) {
+        int c = (i >= fromNum) ? 1 : (j >= toNum) ? -1 :
+                strcmp(magnet_name(from, &from->file[i]), magnet_name(to, &to->file[j]));
+        if(c < 0) {
+            delta->removed[delta->removedNum++] = i++;
+        } else if(c > 0) {
+            delta->added[delta->addedNum++] = j++;
+        } else {
+            if(from->file[i].size != to->file[j].size ||
+               0 != memcmp(from->file[i].digest, to->file[j].digest, CRS_STRONG_DIGEST_SIZE)) {
+                delta->changed[delta->changedNum++] = j;
+            }
+            i++;
+            j++;
+        }
+    }
+}
+
+void magnetDelta_free(magnetDelta_t *delta) {
+    if(delta) {
+        free(delta->added);
+        free(delta->changed);
+        free(delta->removed);
+        memset(delta, 0, sizeof(magnetDelta_t));
     }
 }
 
@@ -63,107 +221,199 @@ void magnet_toString(magnet_t *m, UT_string **str) {
         return;
     UT_string *s = *str;
     utstring_clear(s);
-    sum_t *elt;
-    LL_FOREACH(m->file, elt) {
-        char *hash = Util_hex_string(elt->digest, CRS_STRONG_DIGEST_SIZE);
-        utstring_printf(s, "%s;%s;%u;", elt->name, hash, elt->size);
-        free(hash);
+    char hash[CRS_STRONG_DIGEST_SIZE * 2 + 1];
+    for(uint32_t i=0; i<m->fileNum; ++i) {
+        const sum_t *elt = &m->file[i];
+        for(int k=0; k<CRS_STRONG_DIGEST_SIZE; ++k) {
+            sprintf(hash + k * 2, "%02x", elt->digest[k]);
+        }
+        utstring_printf(s, "%s;%s;%u;", magnet_name(m, elt), hash, elt->size);
     }
 }
 
+static int magnet_hexValue(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
 magnet_t* magnet_fromString(UT_string **str) {
     if(!str || !*str) {
         return NULL;
     }
     magnet_t *m = magnet_malloc();
-    UT_string *s = *str;
-    int findPos = -1;
-    int startPos = 0;
-    int order = 0;
-
-    sum_t *sum = NULL;
-    char findStr[128];//should enough mostly
-
-    while(-1 != (findPos = utstring_find(s, startPos, ";", 1))) {
-        if(!sum)
-            sum = sum_malloc();
-        strncpy(findStr, utstring_body(s) + startPos, findPos - startPos);
-        findStr[findPos - startPos] = '\0';
-
-        switch(order) {
-        case 0: {
-            sum->name = strdup(findStr);
-            break;
-        }
-        case 1: {
-            unsigned char *digest = Util_string_hex(findStr);
-            memcpy(sum->digest, digest, CRS_STRONG_DIGEST_SIZE);
-            free(digest);
-            break;
-        }
-        case 2: {
-            sum->size = (unsigned int)atoi(findStr);
-            LL_APPEND(m->file, sum);
-            sum = NULL;
-            break;
+    const char *p = utstring_body(*str);
+    const char *end = p + utstring_len(*str);
+    //name;hexdigest;size; per file, fields in place, no copy but the name
+    while(p < end) {
+        const char *nameEnd = memchr(p, ';', end - p);
+        const char *hex = nameEnd ? nameEnd + 1 : end;
+        const char *hexEnd = (hex < end) ? memchr(hex, ';', end - hex) : NULL;
+        const char *num = hexEnd ? hexEnd + 1 : end;
+        const char *numEnd = (num < end) ? memchr(num, ';', end - num) : NULL;
+        if(!numEnd) break;
+        uint8_t digest[CRS_STRONG_DIGEST_SIZE];
+        memset(digest, 0, CRS_STRONG_DIGEST_SIZE);
+        for(int k=0; k<CRS_STRONG_DIGEST_SIZE && hex + k * 2 + 1 < hexEnd; ++k) {
+            int hi = magnet_hexValue(hex[k * 2]), lo = magnet_hexValue(hex[k * 2 + 1]);
+            digest[k] = (uint8_t)(((hi < 0) ? 0 : hi) << 4 | ((lo < 0) ? 0 : lo));
         }
-        }
-        order = (order >= 2) ? 0 : order+1;
-        startPos = findPos + 1;
+        uint32_t size = (uint32_t)strtoul(num, NULL, 10);
+        magnet_addN(m, p, nameEnd - p, size, digest);
+        p = numEnd + 1;
     }
-
+    magnet_finish(m);
     return m;
 }
 
-CRScode magnet_load(magnet_t *m, const char *file) {
-    LOGI("begin\n");
-    CRScode code = CRS_OK;
+static CRScode magnet_loadTpl(magnet_t *m, const char *file) {
+    char *curr = NULL;
+    char *next = NULL;
     char *name = NULL;
     unsigned int size = 0;
     unsigned char digest[CRS_STRONG_DIGEST_SIZE];
-    tpl_node *tn = tpl_map(MAGNET_TPL_FORMAT,
-                 &m->currVersion,
-                 &m->nextVersion,
-                 &name,
-                 &size,
-                 &digest,
-                 CRS_STRONG_DIGEST_SIZE);
-    if (0 == tpl_load(tn, TPL_FILE, file) ) {
+    tpl_node *tn = tpl_map(MAGNET_TPL_FORMAT, &curr, &next, &name, &size, &digest, CRS_STRONG_DIGEST_SIZE);
+    CRScode code = CRS_FILE_ERROR;
+    if(0 == tpl_load(tn, TPL_FILE, file)) {
         tpl_unpack(tn, 0);
-        while (tpl_unpack(tn, 1) > 0) {
-            sum_t *s = sum_malloc();
-            s->name = strdup(name);
-            s->size = size;
-            memcpy(s->digest, digest, CRS_STRONG_DIGEST_SIZE);
-            LL_APPEND(m->file, s);
+        m->currVersion = curr;
+        m->nextVersion = next;
+        while(tpl_unpack(tn, 1) > 0) {
+            magnet_add(m, name, size, digest);
+            free(name);
+            name = NULL;
         }
-    } else {
-        code = CRS_FILE_ERROR;
+        magnet_finish(m);
+        code = CRS_OK;
     }
     tpl_free(tn);
+    return code;
+}
+
+CRScode magnet_load(magnet_t *m, const char *file) {
+    LOGI("begin\n");
+    if(!m || !file) {
+        LOGE("end %d\n", CRS_PARAM_ERROR);
+        return CRS_PARAM_ERROR;
+    }
+    magnet_clear(m);
+    if(0 == Util_tplcmp(file, MAGNET_TPL_FORMAT)) {
+        CRScode code = magnet_loadTpl(m, file);
+        LOGI("end tpl %d\n", code);
+        return code;
+    }
+    CRScode code = CRS_FILE_ERROR;
+    fileMap_t *map = Util_mapOpen(file);
+    do {
+        if(!map || map->size < sizeof(magnetHeader_t)) break;
+        magnetHeader_t h;
+        memcpy(&h, map->data, sizeof(magnetHeader_t));
+        if(0 != memcmp(h.magic, MAGNET_MAGIC, 4) || h.version != MAGNET_VERSION) break;
+        //every section inside file, 64 bits sums never overflow
+        uint64_t pos = sizeof(magnetHeader_t);
+        uint64_t curr = pos;
+        uint64_t next = curr + h.currSize;
+        pos = (next + h.nextSize + 3) & ~(uint64_t)3;
+        uint64_t fileAt = pos;
+        pos += (uint64_t)h.fileNum * sizeof(sum_t);
+        uint64_t indexAt = pos;
+        pos += (uint64_t)h.indexSize * sizeof(uint32_t);
+        uint64_t namesAt = pos;
+        pos += h.namesSize;
+        if(pos != map->size || h.currSize == 0 || h.nextSize == 0) break;
+        //load at most 1/2 as magnet_finish keeps, an empty slot always ends magnet_find's probe
+        if((h.indexSize & (h.indexSize - 1)) != 0 || h.indexSize < (uint64_t)h.fileNum * 2) break;
+        if(map->data[next - 1] != '\0' || map->data[next + h.nextSize - 1] != '\0') break;
+        if(h.namesSize > 0 && map->data[namesAt + h.namesSize - 1] != '\0') break;
+        const sum_t *files = (const sum_t*)(map->data + fileAt);
+        const uint32_t *index = (const uint32_t*)(map->data + indexAt);
+        uint32_t i = 0;
+        for(i=0; i<h.fileNum && files[i].nameOffset < h.namesSize; ++i);
+        if(i < h.fileNum) break;
+        uint32_t used = 0;
+        for(i=0; i<h.indexSize && index[i] <= h.fileNum; ++i) {
+            if(index[i] != 0) used++;
+        }
+        if(i < h.indexSize || used > h.fileNum) break;
+
+        m->map = map;
+        m->currVersion = (char*)(map->data + curr);
+        m->nextVersion = (char*)(map->data + next);
+        m->file = (sum_t*)files;
+        m->fileNum = h.fileNum;
+        m->index = (uint32_t*)index;
+        m->indexSize = h.indexSize;
+        m->names = (char*)(map->data + namesAt);
+        m->namesSize = h.namesSize;
+        map = NULL;
+        code = CRS_OK;
+    } while(0);
+    if(map) {
+        LOGE("bad magnet %s\n", file);
+        Util_mapClose(map);
+    }
     LOGI("end %d\n", code);
     return code;
 }
 
 CRScode magnet_save(magnet_t *m, const char *file) {
     LOGI("begin\n");
+    if(!m || !file) {
+        LOGE("end %d\n", CRS_PARAM_ERROR);
+        return CRS_PARAM_ERROR;
+    }
+    if(m->indexSize == 0) {
+        magnet_finish(m);
+    }
+    const char *curr = m->currVersion ? m->currVersion : "";
+    const char *next = m->nextVersion ? m->nextVersion : "";
+    magnetHeader_t h;
+    memcpy(h.magic, MAGNET_MAGIC, 4);
+    h.version = MAGNET_VERSION;
+    h.fileNum = m->fileNum;
+    h.namesSize = m->namesSize;
+    h.indexSize = m->indexSize;
+    h.currSize = strlen(curr) + 1;
+    h.nextSize = strlen(next) + 1;
+    size_t pad = (4 - (sizeof(magnetHeader_t) + h.currSize + h.nextSize) % 4) % 4;
+    const char zeros[4] = {0, 0, 0, 0};
+
+    CRScode code = CRS_OK;
+    FILE *f = fopen(file, "wb");
+    if(!f ||
+       1 != fwrite(&h, sizeof(magnetHeader_t), 1, f) ||
+       h.currSize != fwrite(curr, 1, h.currSize, f) ||
+       h.nextSize != fwrite(next, 1, h.nextSize, f) ||
+       pad != fwrite(zeros, 1, pad, f) ||
+       m->fileNum != fwrite(m->file, sizeof(sum_t), m->fileNum, f) ||
+       m->indexSize != fwrite(m->index, sizeof(uint32_t), m->indexSize, f) ||
+       m->namesSize != fwrite(m->names, 1, m->namesSize, f)) {
+        LOGE("%s write error\n", file);
+        code = CRS_FILE_ERROR;
+    }
+    if(f) fclose(f);
+    LOGI("end %d\n", code);
+    return code;
+}
+
+CRScode magnet_saveTpl(magnet_t *m, const char *file) {
+    LOGI("begin\n");
+    if(!m || !file) {
+        LOGE("end %d\n", CRS_PARAM_ERROR);
+        return CRS_PARAM_ERROR;
+    }
+    char *curr = m->currVersion ? m->currVersion : "";
+    char *next = m->nextVersion ? m->nextVersion : "";
     char *name = NULL;
     unsigned int size = 0;
     unsigned char digest[CRS_STRONG_DIGEST_SIZE];
-    tpl_node *tn = tpl_map(MAGNET_TPL_FORMAT,
-                 &m->currVersion,
-                 &m->nextVersion,
-                 &name,
-                 &size,
-                 &digest,
-                 CRS_STRONG_DIGEST_SIZE);
+    tpl_node *tn = tpl_map(MAGNET_TPL_FORMAT, &curr, &next, &name, &size, &digest, CRS_STRONG_DIGEST_SIZE);
     tpl_pack(tn, 0);
-
-    sum_t *elt=NULL;
-    LL_FOREACH(m->file,elt) {
-        name = elt->name;
-        size = elt->size;
-        memcpy(digest,elt->digest, CRS_STRONG_DIGEST_SIZE);
+    for(uint32_t i=0; i<m->fileNum; ++i) {
+        name = m->names + m->file[i].nameOffset;
+        size = m->file[i].size;
+        memcpy(digest, m->file[i].digest, CRS_STRONG_DIGEST_SIZE);
         tpl_pack(tn, 1);
     }
     int result = tpl_dump(tn, TPL_FILE, file);
@@ -174,5 +424,11 @@ CRScode magnet_save(magnet_t *m, const char *file) {
 }
 
 int Magnet_checkfile(const char *filename) {
+    magnetHeader_t h;
+    FILE *f = fopen(filename, "rb");
+    if(!f) return -1;
+    size_t r = fread(&h, sizeof(magnetHeader_t), 1, f);
+    fclose(f);
+    if(r == 1 && 0 == memcmp(h.magic, MAGNET_MAGIC, 4) && h.version == MAGNET_VERSION) return 0;
     return Util_tplcmp(filename, MAGNET_TPL_FORMAT);
 }
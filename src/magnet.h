@@ -24,37 +24,76 @@ SOFTWARE.
 #ifndef CRS_MAGNET_H
 #define CRS_MAGNET_H
 
+#include <stdint.h>
+
 #include "global.h"
 #include "utstring.h"
 
 extern const char *MAGNET_EXT;
 
+//one file of magnet, fixed size, name in magnet_t.names
 typedef struct sum_t {
-    char            *name;
-    unsigned int    size;
-    unsigned char   digest[CRS_STRONG_DIGEST_SIZE];
-    struct sum_t    *next; //utlist(single-link)
+    uint32_t    nameOffset; //in magnet_t.names, '\0' terminated
+    uint32_t    size;
+    uint8_t     digest[CRS_STRONG_DIGEST_SIZE];
 } sum_t;
 
-sum_t*  sum_malloc();
-void    sum_free(sum_t *s);
+struct fileMap_t;
 
+//file array sorted by name with hash index, all in few blocks;
+//magnet_load maps the binary file and points into it, no copy
 typedef struct magnet_t {
-    char    *currVersion;
-    char    *nextVersion;
-    sum_t   *file; //utlist(single-link)
+    char        *currVersion;
+    char        *nextVersion;
+    sum_t       *file; //fileNum entries, sorted by name after magnet_finish
+    uint32_t    fileNum;
+    char        *names; //string table
+    uint32_t    namesSize;
+    uint32_t    *index; //open addressing by name hash, file index + 1, 0 empty
+    uint32_t    indexSize; //power of 2, 0 before magnet_finish
+    uint32_t    fileCap; //capacity of file, grown by magnet_add
+    uint32_t    namesCap; //capacity of names
+    struct fileMap_t *map; //loaded binary file, NULL if arrays are malloced
 } magnet_t;
 
 magnet_t*   magnet_malloc();
 void        magnet_free(magnet_t *m);
 
+//append one file, magnet_finish before magnet_find or magnet_save
+void        magnet_add(magnet_t *m, const char *name, uint32_t size, const uint8_t *digest);
+//sort files by name and build hash index
+void        magnet_finish(magnet_t *m);
+
+const char* magnet_name(const magnet_t *m, const sum_t *s);
+//O(1) by hash index, NULL if not found
+const sum_t* magnet_find(const magnet_t *m, const char *name);
+
+//files of to against from by (name, size, digest), indexes in sorted file arrays
+typedef struct magnetDelta_t {
+    uint32_t    *added; //in to only, index of to->file
+    uint32_t    addedNum;
+    uint32_t    *changed; //in both but size or digest differs, index of to->file
+    uint32_t    changedNum;
+    uint32_t    *removed; //in from only, index of from->file
+    uint32_t    removedNum;
+} magnetDelta_t;
+
+//one merge pass over both name sorted arrays, both magnet_finish'ed or loaded
+void        magnet_delta(const magnet_t *from, const magnet_t *to, magnetDelta_t *delta);
+void        magnetDelta_free(magnetDelta_t *delta);
+
+//"name;hexdigest;size;" of every file
 void        magnet_toString(magnet_t *m, UT_string **str);
 magnet_t*   magnet_fromString(UT_string **str);
 
+//binary file: header, versions, file array, index, names; host byte order,
+//another order fails the version check.
+//magnet_load reads the older tpl file too, into malloced arrays
 CRScode     magnet_load(magnet_t *m, const char *file);
 CRScode     magnet_save(magnet_t *m, const char *file);
+//tpl file as older versions read, for magnets published to them
+CRScode     magnet_saveTpl(magnet_t *m, const char *file);
 
 int Magnet_checkfile(const char *filename);
 
 #endif // CRS_MAGNET_H
-
@@ -0,0 +1,467 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 chenqi
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "merkle.h"
+#include "http.h"
+#include "log.h"
+#include "utstring.h"
+
+const char *MERKLE_EXT = ".tree";
+const char *MERKLE_FINE_EXT = ".fine.tree";
+
+static uint32_t s_fineDivisor = 0;
+
+void Merkle_setFineDivisor(uint32_t divisor) {
+    s_fineDivisor = divisor;
+}
+
+uint32_t Merkle_getFineDivisor() {
+    return s_fineDivisor;
+}
+
+static const char MERKLE_MAGIC[8] = {'c','r','s','t','r','e','e','1'};
+
+//magic, fileSize, blockSize, fanout, digestMode, fileDigest
+#define MERKLE_HEADER_SIZE (8 + 4*4 + CRS_STRONG_DIGEST_SIZE)
+//leaf is one block digest_t, strong + weak(little endian)
+#define MERKLE_LEAF_SIZE (CRS_STRONG_DIGEST_SIZE + 4)
+#define MERKLE_NODE_SIZE CRS_STRONG_DIGEST_SIZE
+//ranges per request while fetching
+#define MERKLE_RANGES 32
+
+static void Merkle_put32(uint8_t *p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static uint32_t Merkle_get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+//layout of one tree file, level 0 is root, level levelNum-1 is leaves
+typedef struct merkleTree_t {
+    uint32_t fileSize;
+    uint32_t blockSize;
+    uint32_t fanout;
+    uint32_t levelNum;
+    uint32_t *count; //nodes of each level
+    size_t   *offset; //file offset of each level
+    size_t   restOffset;
+    size_t   size; //whole tree file size
+    uint8_t  *image; //whole tree file content
+} merkleTree_t;
+
+static void merkleTree_free(merkleTree_t *t) {
+    if(t) {
+        free(t->count);
+        free(t->offset);
+        free(t->image);
+        free(t);
+    }
+}
+
+static merkleTree_t* merkleTree_layout(uint32_t fileSize, uint32_t blockSize, uint32_t fanout) {
+    if(blockSize == 0 || fanout < 2) return NULL;
+    merkleTree_t *t = calloc(1, sizeof(merkleTree_t));
+    t->fileSize = fileSize;
+    t->blockSize = blockSize;
+    t->fanout = fanout;
+    uint32_t blockNum = fileSize / blockSize;
+    //levels above leaves until one root
+    uint32_t levelNum = (blockNum > 0) ? 1 : 0;
+    for(uint32_t n = blockNum; n > 1; n = (n + fanout - 1) / fanout) {
+        levelNum++;
+    }
+    if(blockNum == 1) levelNum = 2; //root over single leaf
+    t->levelNum = levelNum;
+    t->count = calloc(levelNum + 1, sizeof(uint32_t));
+    t->offset = calloc(levelNum + 1, sizeof(size_t));
+    if(levelNum > 0) {
+        t->count[levelNum-1] = blockNum;
+        for(int l = (int)levelNum - 2; l >= 0; --l) {
+            t->count[l] = (t->count[l+1] + fanout - 1) / fanout;
+        }
+    }
+    t->restOffset = MERKLE_HEADER_SIZE;
+    size_t pos = MERKLE_HEADER_SIZE + fileSize % blockSize;
+    for(uint32_t l=0; l<levelNum; ++l) {
+        t->offset[l] = pos;
+        pos += (size_t)t->count[l] * ((l == levelNum - 1) ? MERKLE_LEAF_SIZE : MERKLE_NODE_SIZE);
+    }
+    t->size = pos;
+    return t;
+}
+
+static size_t merkleTree_unit(const merkleTree_t *t, uint32_t level) {
+    return (level == t->levelNum - 1) ? MERKLE_LEAF_SIZE : MERKLE_NODE_SIZE;
+}
+
+static uint8_t* merkleTree_node(const merkleTree_t *t, uint32_t level, uint32_t i) {
+    return t->image + t->offset[level] + (size_t)i * merkleTree_unit(t, level);
+}
+
+//hash of node i at level, from its children at level+1
+static void merkleTree_hash(const merkleTree_t *t, uint32_t level, uint32_t i, uint8_t *out) {
+    uint32_t first = i * t->fanout;
+    uint32_t last = first + t->fanout;
+    if(last > t->count[level+1]) last = t->count[level+1];
+    Digest_CalcStrong_Data(merkleTree_node(t, level+1, first),
+                           (last - first) * merkleTree_unit(t, level+1), out);
+}
+
+//whole tree image of fd
+static merkleTree_t* merkleTree_build(const fileDigest_t *fd, uint32_t fanout) {
+    merkleTree_t *t = merkleTree_layout(fd->fileSize, fd->blockSize, fanout);
+    if(!t) return NULL;
+    t->image = calloc(1, t->size);
+    uint8_t *p = t->image;
+    memcpy(p, MERKLE_MAGIC, sizeof(MERKLE_MAGIC));
+    Merkle_put32(p + 8, fd->fileSize);
+    Merkle_put32(p + 12, fd->blockSize);
+    Merkle_put32(p + 16, fanout);
+    Merkle_put32(p + 20, fd->digestMode);
+    memcpy(p + 24, fd->fileDigest, CRS_STRONG_DIGEST_SIZE);
+    if(fd->fileSize % fd->blockSize > 0) {
+        memcpy(p + t->restOffset, fd->restData, fd->fileSize % fd->blockSize);
+    }
+    if(t->levelNum > 0) {
+        uint32_t leaf = t->levelNum - 1;
+        for(uint32_t i=0; i<t->count[leaf]; ++i) {
+            uint8_t *n = merkleTree_node(t, leaf, i);
+            memcpy(n, fd->blockDigest[i].strong, CRS_STRONG_DIGEST_SIZE);
+            Merkle_put32(n + CRS_STRONG_DIGEST_SIZE, fd->blockDigest[i].weak);
+        }
+        for(int l = (int)leaf - 1; l >= 0; --l) {
+            for(uint32_t i=0; i<t->count[l]; ++i) {
+                merkleTree_hash(t, l, i, merkleTree_node(t, l, i));
+            }
+        }
+    }
+    return t;
+}
+
+//1 if node i at level same as old's, then its subtree copied from old
+static int merkleTree_same(merkleTree_t *t, const merkleTree_t *o, uint32_t level, uint32_t i) {
+    if(!o || o->levelNum != t->levelNum || level + 1 >= t->levelNum || i >= o->count[level] ||
+       0 != memcmp(merkleTree_node(o, level, i), merkleTree_node(t, level, i), MERKLE_NODE_SIZE)) {
+        return 0;
+    }
+    uint64_t first = i, num = 1;
+    for(uint32_t k=level+1; k<t->levelNum; ++k) {
+        first *= t->fanout;
+        num *= t->fanout;
+        uint64_t last = first + num;
+        if(last > t->count[k]) last = t->count[k];
+        if(last > o->count[k]) last = o->count[k];
+        if(first < last) {
+            memcpy(merkleTree_node(t, k, first), merkleTree_node(o, k, first), (last - first) * merkleTree_unit(t, k));
+        }
+    }
+    return 1;
+}
+
+CRScode Merkle_Save(const char *filename, const fileDigest_t *fd) {
+    LOGI("begin\n");
+
+    if(!filename || !fd) {
+        LOGE("end %d\n", CRS_PARAM_ERROR);
+        return CRS_PARAM_ERROR;
+    }
+
+    CRScode code = CRS_OK;
+    merkleTree_t *t = merkleTree_build(fd, MERKLE_FANOUT);
+    FILE *f = t ? fopen(filename, "wb") : NULL;
+    if(!f || t->size != fwrite(t->image, 1, t->size, f)) {
+        LOGE("error %s fwrite\n", filename);
+        code = CRS_FILE_ERROR;
+    }
+    if(f) fclose(f);
+    merkleTree_free(t);
+
+    LOGI("end %d\n", code);
+    return code;
+}
+
+//range data into tree image
+typedef struct merkleFetch_t {
+    uint8_t *image;
+    size_t  size;
+    size_t  got; //Bytes received
+} merkleFetch_t;
+
+static size_t Merkle_callback(size_t offset, const void *data, size_t size, void *userp) {
+    merkleFetch_t *mf = (merkleFetch_t*)userp;
+    if(offset + size > mf->size) {
+        LOGE("range data %lu-%lu out of tree\n", (unsigned long)offset, (unsigned long)(offset + size));
+        return 0;
+    }
+    memcpy(mf->image + offset, data, size);
+    mf->got += size;
+    return size;
+}
+
+//fetch ranges string, return CRS_OK only if server sent exactly expected Bytes
+static CRScode Merkle_range(CURL *curl, const char *url, UT_string *ranges, size_t expected, merkleFetch_t *mf) {
+    httpRange_t hr;
+    memset(&hr, 0, sizeof(hr));
+    hr.callback = Merkle_callback;
+    hr.data = mf;
+    mf->got = 0;
+    CURLcode curlcode = HTTP_Range(curl, url, utstring_body(ranges), &hr);
+    curl_easy_reset(curl);
+    if(curlcode != CURLE_OK || hr.isWhole || mf->got != expected) {
+        LOGE("tree range fail, curlcode %d got %lu expected %lu\n", curlcode, (unsigned long)mf->got, (unsigned long)expected);
+        return CRS_HTTP_ERROR;
+    }
+    return CRS_OK;
+}
+
+//request nodes [first, last) of every marked run at level
+static CRScode Merkle_level(CURL *curl, const char *url, merkleTree_t *t, uint32_t level,
+                            const uint8_t *need, merkleFetch_t *mf) {
+    CRScode code = CRS_OK;
+    UT_string *ranges = NULL;
+    utstring_new(ranges);
+    size_t unit = merkleTree_unit(t, level);
+    uint32_t rangeNum = 0;
+    size_t expected = 0;
+    for(uint32_t i=0; i<t->count[level] && code == CRS_OK; ) {
+        if(!need[i]) { ++i; continue; }
+        uint32_t j = i;
+        while(j < t->count[level] && need[j]) ++j;
+        size_t from = t->offset[level] + (size_t)i * unit;
+        size_t to = t->offset[level] + (size_t)j * unit - 1;
+        utstring_printf(ranges, (rangeNum == 0) ? "%lu-%lu" : ",%lu-%lu", (unsigned long)from, (unsigned long)to);
+        expected += to - from + 1;
+        rangeNum++;
+        i = j;
+        if(rangeNum == MERKLE_RANGES) {
+            code = Merkle_range(curl, url, ranges, expected, mf);
+            utstring_clear(ranges);
+            rangeNum = 0;
+            expected = 0;
+        }
+    }
+    if(code == CRS_OK && rangeNum > 0) {
+        code = Merkle_range(curl, url, ranges, expected, mf);
+    }
+    utstring_free(ranges);
+    return code;
+}
+
+//fetch header, return tree layout with header in its image
+static merkleTree_t* Merkle_header(CURL *curl, const char *url) {
+    uint8_t header[MERKLE_HEADER_SIZE];
+    merkleFetch_t mf = {header, MERKLE_HEADER_SIZE, 0};
+    UT_string *ranges = NULL;
+    utstring_new(ranges);
+    utstring_printf(ranges, "0-%d", MERKLE_HEADER_SIZE - 1);
+    CRScode code = Merkle_range(curl, url, ranges, MERKLE_HEADER_SIZE, &mf);
+    utstring_free(ranges);
+    if(code != CRS_OK) {
+        return NULL;
+    }
+    if(0 != memcmp(header, MERKLE_MAGIC, sizeof(MERKLE_MAGIC))) {
+        LOGE("tree magic wrong\n");
+        return NULL;
+    }
+    merkleTree_t *t = merkleTree_layout(Merkle_get32(header + 8), Merkle_get32(header + 12), Merkle_get32(header + 16));
+    if(t) {
+        t->image = calloc(1, t->size);
+        memcpy(t->image, header, MERKLE_HEADER_SIZE);
+    }
+    return t;
+}
+
+CRScode Merkle_Fetch(const char *url, const fileDigest_t *old, fileDigest_t *fd) {
+    LOGI("begin\n");
+
+    if(!url || !old || !fd) {
+        LOGE("end %d\n", CRS_PARAM_ERROR);
+        return CRS_PARAM_ERROR;
+    }
+
+    CURL *curl = HTTP_easy_acquire();
+    if(!curl) {
+        LOGE("end %d\n", CRS_INIT_ERROR);
+        return CRS_INIT_ERROR;
+    }
+
+    CRScode code = CRS_OK;
+    merkleTree_t *t = NULL;
+    merkleTree_t *o = NULL;
+    uint8_t *need = NULL;
+    merkleFetch_t mf = {NULL, 0, 0};
+    UT_string *ranges = NULL;
+    utstring_new(ranges);
+
+    do {
+        t = Merkle_header(curl, url);
+        if(!t || t->levelNum == 0 || t->blockSize != old->blockSize) {
+            LOGI("tree not comparable with old digest\n");
+            code = CRS_PARAM_ERROR;
+            break;
+        }
+        o = merkleTree_build(old, t->fanout);
+        mf.image = t->image;
+        mf.size = t->size;
+
+        //rest data and root
+        utstring_clear(ranges);
+        size_t restSize = t->fileSize % t->blockSize;
+        if(restSize > 0) {
+            utstring_printf(ranges, "%lu-%lu,", (unsigned long)t->restOffset, (unsigned long)(t->restOffset + restSize - 1));
+        }
+        utstring_printf(ranges, "%lu-%lu", (unsigned long)t->offset[0], (unsigned long)(t->offset[0] + MERKLE_NODE_SIZE - 1));
+        code = Merkle_range(curl, url, ranges, restSize + MERKLE_NODE_SIZE, &mf);
+        if(code != CRS_OK) break;
+
+        //descend only into nodes differ from old
+        need = calloc(t->count[t->levelNum-1] + 1, 1);
+        uint8_t *differ = calloc(t->count[t->levelNum-1] + 1, 1);
+        differ[0] = !merkleTree_same(t, o, 0, 0);
+        uint32_t fetchNum = 1;
+        for(uint32_t l=0; l+1<t->levelNum && code == CRS_OK; ++l) {
+            //children of differ nodes at level l
+            memset(need, 0, t->count[l+1]);
+            for(uint32_t i=0; i<t->count[l]; ++i) {
+                if(!differ[i]) continue;
+                uint32_t last = (i + 1) * t->fanout;
+                if(last > t->count[l+1]) last = t->count[l+1];
+                memset(need + i * t->fanout, 1, last - i * t->fanout);
+            }
+            code = Merkle_level(curl, url, t, l+1, need, &mf);
+            if(code != CRS_OK) break;
+            //fetched children must match their parent
+            uint8_t hash[MERKLE_NODE_SIZE];
+            for(uint32_t i=0; i<t->count[l]; ++i) {
+                if(!differ[i]) continue;
+                merkleTree_hash(t, l, i, hash);
+                if(0 != memcmp(hash, merkleTree_node(t, l, i), MERKLE_NODE_SIZE)) {
+                    LOGE("tree node %d-%d digest wrong\n", l, i);
+                    code = CRS_HTTP_ERROR;
+                    break;
+                }
+            }
+            for(uint32_t i=0; i<t->count[l+1]; ++i) {
+                fetchNum += need[i];
+                differ[i] = need[i] && !merkleTree_same(t, o, l+1, i);
+            }
+        }
+        free(differ);
+        if(code != CRS_OK) break;
+        LOGI("tree nodes fetched %d, leaves %d\n", fetchNum, t->count[t->levelNum-1]);
+
+        //tree complete, same as a loaded .sum
+        uint32_t leaf = t->levelNum - 1;
+        fd->fileSize = t->fileSize;
+        fd->blockSize = t->blockSize;
+        fd->digestMode = Merkle_get32(t->image + 20);
+        memcpy(fd->fileDigest, t->image + 24, CRS_STRONG_DIGEST_SIZE);
+        fd->blockDigest = malloc(sizeof(digest_t) * t->count[leaf]);
+        for(uint32_t i=0; i<t->count[leaf]; ++i) {
+            const uint8_t *n = merkleTree_node(t, leaf, i);
+            memcpy(fd->blockDigest[i].strong, n, CRS_STRONG_DIGEST_SIZE);
+            fd->blockDigest[i].weak = Merkle_get32(n + CRS_STRONG_DIGEST_SIZE);
+        }
+        fd->restData = (restSize > 0) ? malloc(restSize) : NULL;
+        if(restSize > 0) {
+            memcpy(fd->restData, t->image + t->restOffset, restSize);
+        }
+        if(fd->digestMode == DIGEST_MODE_TREE) {
+            uint8_t hash[CRS_STRONG_DIGEST_SIZE];
+            Digest_CalcTree(fd, hash);
+            if(0 != memcmp(hash, fd->fileDigest, CRS_STRONG_DIGEST_SIZE)) {
+                LOGE("tree leaves not match fileDigest\n");
+                code = CRS_HTTP_ERROR;
+            }
+        }
+    } while(0);
+
+    utstring_free(ranges);
+    free(need);
+    merkleTree_free(o);
+    merkleTree_free(t);
+    HTTP_easy_release(curl);
+    LOGI("end %d\n", code);
+    return code;
+}
+
+CRScode Merkle_FetchMissing(const char *url, const fileDigest_t *fd, const diffResult_t *dr, fileDigest_t *fine) {
+    LOGI("begin\n");
+
+    if(!url || !fd || !dr || !fine) {
+        LOGE("end %d\n", CRS_PARAM_ERROR);
+        return CRS_PARAM_ERROR;
+    }
+
+    CURL *curl = HTTP_easy_acquire();
+    if(!curl) {
+        LOGE("end %d\n", CRS_INIT_ERROR);
+        return CRS_INIT_ERROR;
+    }
+
+    CRScode code = CRS_OK;
+    uint8_t *need = NULL;
+    merkleTree_t *t = Merkle_header(curl, url);
+    do {
+        if(!t || t->levelNum == 0 || t->fileSize != fd->fileSize ||
+           t->blockSize >= fd->blockSize || fd->blockSize % t->blockSize != 0) {
+            LOGI("fine tree not usable\n");
+            code = CRS_PARAM_ERROR;
+            break;
+        }
+        uint32_t leaf = t->levelNum - 1;
+        uint32_t k = fd->blockSize / t->blockSize;
+        need = calloc(t->count[leaf] + 1, 1);
+        for(int32_t i=0; i<dr->totalNum; ++i) {
+            if(dr->offsets[i] == -1) {
+                memset(need + (size_t)i * k, 1, k);
+            }
+        }
+        merkleFetch_t mf = {t->image, t->size, 0};
+        code = Merkle_level(curl, url, t, leaf, need, &mf);
+        if(code != CRS_OK) break;
+
+        fine->fileSize = t->fileSize;
+        fine->blockSize = t->blockSize;
+        fine->digestMode = Merkle_get32(t->image + 20);
+        memcpy(fine->fileDigest, t->image + 24, CRS_STRONG_DIGEST_SIZE);
+        fine->blockDigest = calloc(t->count[leaf] + 1, sizeof(digest_t));
+        for(uint32_t i=0; i<t->count[leaf]; ++i) {
+            if(!need[i]) continue;
+            const uint8_t *n = merkleTree_node(t, leaf, i);
+            memcpy(fine->blockDigest[i].strong, n, CRS_STRONG_DIGEST_SIZE);
+            fine->blockDigest[i].weak = Merkle_get32(n + CRS_STRONG_DIGEST_SIZE);
+        }
+    } while(0);
+
+    free(need);
+    merkleTree_free(t);
+    HTTP_easy_release(curl);
+    LOGI("end %d\n", code);
+    return code;
+}
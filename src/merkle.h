@@ -0,0 +1,63 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 chenqi
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef CRS_MERKLE_H
+#define CRS_MERKLE_H
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+#include "global.h"
+#include "digest.h"
+#include "diff.h"
+
+//merkle tree of fileDigest_t, saved beside .sum as .sum.tree
+extern const char *MERKLE_EXT;
+
+//children per node
+#define MERKLE_FANOUT 64
+
+//tree of smaller blocks beside .sum as .sum.fine.tree, used to refine missing blocks
+extern const char *MERKLE_FINE_EXT;
+
+//fine blockSize = blockSize / divisor, 0 or 1 means no fine tree.
+//digest side writes fine tree, diff side fetches it
+void     Merkle_setFineDivisor(uint32_t divisor);
+uint32_t Merkle_getFineDivisor();
+
+//same content as Digest_Save, but range addressable:
+//header, rest data, node levels from root, leaves(block digests)
+CRScode Merkle_Save(const char *filename, const fileDigest_t *fd);
+
+//fetch fd from url by http range, only subtrees differ from old's tree
+CRScode Merkle_Fetch(const char *url, const fileDigest_t *old, fileDigest_t *fd);
+
+//fetch fine's block digests under dr's missing blocks of fd only, others left zero
+CRScode Merkle_FetchMissing(const char *url, const fileDigest_t *fd, const diffResult_t *dr, fileDigest_t *fine);
+
+#if defined __cplusplus
+}
+#endif
+
+#endif // CRS_MERKLE_H
@@ -24,6 +24,7 @@ SOFTWARE.
 #include <sys/stat.h>
 #include <stdio.h>
 #include <errno.h>
+#include <omp.h>
 
 #ifdef _MSC_VER
 #   include "win/libgen.h"
@@ -38,60 +39,282 @@ SOFTWARE.
 #include "util.h"
 #include "log.h"
 #include "http.h"
+#include "utstring.h"
+#include "uthash.h"
 
-static CRScode Patch_match(const char *srcFilename, const char *dstFilename,
-                           const fileDigest_t *fd, const diffResult_t *dr) {
+//continuous matched blocks, copied from src to dst at once
+typedef struct copyrun_t {
+    size_t src;
+    size_t dst;
+    size_t len;
+} copyrun_t;
+
+static int copyrun_cmp(const void *a, const void *b) {
+    const copyrun_t *x = a, *y = b;
+    return (x->src < y->src) ? -1 : (x->src > y->src);
+}
+
+//blocks continuous in both src and dst become one run, runs has dr->totalNum at most
+static uint32_t Patch_matchRuns(const fileDigest_t *fd, const diffResult_t *dr, copyrun_t *runs) {
+    uint32_t runNum = 0;
+    for(int i=0; i<dr->totalNum; ++i) {
+        if(dr->offsets[i] < 0) continue;
+        size_t pos = (size_t)i * fd->blockSize;
+        copyrun_t *last = (runNum > 0) ? &runs[runNum-1] : NULL;
+        if(last && last->dst + last->len == pos && last->src + last->len == (size_t)dr->offsets[i]) {
+            last->len += fd->blockSize;
+        } else {
+            runs[runNum].src = dr->offsets[i];
+            runs[runNum].dst = pos;
+            runs[runNum].len = fd->blockSize;
+            runNum++;
+        }
+    }
+    return runNum;
+}
+
+//copy matched blocks, each one checked against its strong digest as read,
+//since a local digest may match blocks without reading them. changed ones go back to missing.
+//refined fd has no digests under coarseDr's matched blocks, those blocks come in coarse aligned
+//runs and are checked by coarse ones; coarseDr NULL if fd is not refined
+static CRScode Patch_match(const char *srcFilename, fileWriter_t *dst, const fileDigest_t *fd, diffResult_t *dr,
+                           const fileDigest_t *coarse, const diffResult_t *coarseDr) {
     LOGI("begin\n");
-    if(!srcFilename || !dstFilename || !fd || !dr) {
+    if(!srcFilename || !dst || !fd || !dr || !coarse) {
         LOGE("end %d\n", CRS_PARAM_ERROR);
         return CRS_PARAM_ERROR;
     }
 
-    FILE *f1 = fopen(srcFilename, "rb");
-    if(!f1){
+    CRScode code = CRS_OK;
+
+    copyrun_t *runs = malloc(sizeof(copyrun_t) * (dr->totalNum > 0 ? dr->totalNum : 1));
+    uint32_t runNum = Patch_matchRuns(fd, dr, runs);
+    //src may not exist when nothing matched, a new file
+    FILE *f1 = (runNum > 0) ? fopen(srcFilename, "rb") : NULL;
+    if(runNum > 0 && !f1){
         LOGE("source file fopen error %s\n", strerror(errno));
+        free(runs);
         return CRS_FILE_ERROR;
     }
+    //sequential read of src
+    qsort(runs, runNum, sizeof(copyrun_t), copyrun_cmp);
+    LOGI("copy runs Num = %d\n", runNum);
 
-    FILE *f2 = fopen(dstFilename, "rb+");
-    if(!f2){
-        LOGE("dest file fopen error %s\n", strerror(errno));
-        fclose(f1);
-        return CRS_FILE_ERROR;
+    const size_t blockSize = fd->blockSize;
+    const uint32_t ratio = coarse->blockSize / fd->blockSize;
+    uint8_t *buf = malloc(blockSize);
+    uint8_t hash[CRS_STRONG_DIGEST_SIZE];
+    strongCtx_t ctx;
+    Digest_CalcStrong_Init(&ctx);
+    int32_t failNum = 0;
+    for(uint32_t i=0; i<runNum && code == CRS_OK; ++i) {
+        if(0 != fseek(f1, runs[i].src, SEEK_SET)) {
+            code = CRS_FILE_ERROR;
+            break;
+        }
+        for(size_t k=0; k<runs[i].len; k+=blockSize) {
+            size_t pos = runs[i].dst + k;
+            int32_t seq = pos / blockSize;
+            //read straight into mapped dst if any
+            uint8_t *p = Util_writerPtr(dst, pos, blockSize);
+            uint8_t *data = p ? p : buf;
+            if(blockSize != fread(data, 1, blockSize, f1)) {
+                code = CRS_FILE_ERROR;
+                break;
+            }
+            int32_t c = seq / ratio;
+            uint32_t j = seq % ratio;
+            if(coarseDr && coarseDr->offsets[c] >= 0 &&
+               dr->offsets[seq] == coarseDr->offsets[c] + (int32_t)(j * blockSize)) {
+                Digest_CalcStrong_Update(&ctx, data, blockSize); //reset after each coarse block
+                if(j + 1 == ratio) {
+                    Digest_CalcStrong_Final(&ctx, hash);
+                    Digest_CalcStrong_Init(&ctx);
+                    if(0 != memcmp(hash, coarse->blockDigest[c].strong, CRS_STRONG_DIGEST_SIZE)) {
+                        for(uint32_t n=0; n<ratio; ++n) {
+                            dr->offsets[(size_t)c * ratio + n] = -1;
+                        }
+                        dr->matchNum -= ratio;
+                        failNum += ratio;
+                    }
+                }
+                if(!p && 0 != Util_writerWrite(dst, pos, buf, blockSize)) {
+                    code = CRS_FILE_ERROR;
+                    break;
+                }
+                continue;
+            }
+            Digest_CalcStrong_Data(data, blockSize, hash);
+            if(0 != memcmp(hash, fd->blockDigest[seq].strong, CRS_STRONG_DIGEST_SIZE)) {
+                dr->offsets[seq] = -1;
+                dr->matchNum--;
+                failNum++;
+            } else if(!p && 0 != Util_writerWrite(dst, pos, buf, blockSize)) {
+                code = CRS_FILE_ERROR;
+                break;
+            }
+        }
+    }
+    free(buf);
+    free(runs);
+    if(code != CRS_OK) {
+        LOGE("source file copy error\n");
+    }
+    if(failNum > 0) {
+        LOGW("matched blocks %d changed in source, download them\n", failNum);
     }
 
-    CRScode code = CRS_OK;
-    uint8_t *buf = malloc(fd->blockSize);
+    //coarse rest covers fd's, and the refined blocks inside it
+    size_t restSize = coarse->fileSize % coarse->blockSize;
+    if(restSize > 0 && code == CRS_OK){
+        if(0 != Util_writerWrite(dst, coarse->fileSize - restSize, coarse->restData, restSize)) {
+            code = CRS_FILE_ERROR;
+        }
+    }
 
-    for(int i=0; i<dr->totalNum; ++i) {
-        if(dr->offsets[i] >= 0) {
-            fseek(f1, dr->offsets[i], SEEK_SET);
-            fread(buf, 1, fd->blockSize, f1);
+    if(f1) fclose(f1);
+    LOGI("end %d\n", code);
+    return code;
+}
+
+static patchOption_t s_option = {
+    100,            //rtt 100ms
+    1024*1024,      //bandwidth 1MB/s
+    1024,           //headerBytes 1KB
+    8*1024*1024,    //maxRangeBytes 8MB
+    16,             //rangesPerRequest
+    4,              //connections
+    0,              //inplace
+    4*1024*1024,    //inplaceBuffer 4MB
+    0,              //sparse
+    100*1024*1024,  //copySpeed 100MB/s
+    1,              //planner
+    1,              //adaptive
+};
+
+//zero means start from s_option
+static patchTuner_t s_tuner = {0, 0, 0, 0, 0};
+static double s_tunerStart = 0; //throughput window start, seconds
+static size_t s_tunerBytes = 0; //throughput window bytes
+static uint32_t s_missActive = 0; //concurrent Patch_miss, sharing tuner connections
+
+//throughput measured over at least this long, seconds
+#define PATCH_TUNE_WINDOW 0.5
+
+void Patch_getOption(patchOption_t *opt) {
+    if(opt) *opt = s_option;
+}
+
+void Patch_setOption(const patchOption_t *opt) {
+    if(opt) s_option = *opt;
+#pragma omp critical (patch_tuner)
+    memset(&s_tuner, 0, sizeof(patchTuner_t));
+}
+
+void Patch_getTuner(patchTuner_t *tuner) {
+    if(!tuner) return;
+#pragma omp critical (patch_tuner)
+    *tuner = s_tuner;
+    httpLink_t link;
+    HTTP_getLink(&link);
+    tuner->rtt = link.rtt;
+}
+
+//one Patch_miss's part of connections, tuner connections is for all
+static void Patch_tuneShare(patchTuner_t *tuner) {
+    uint32_t active = (s_missActive > 0) ? s_missActive : 1;
+    tuner->connections = (tuner->connections / active > 0) ? tuner->connections / active : 1;
+}
 
-            fseek(f2, i*fd->blockSize, SEEK_SET);
-            fwrite(buf, 1, fd->blockSize, f2);
+//keep tuner inside s_option, start from half of max
+static void Patch_tuneBegin(patchTuner_t *tuner, uint32_t blockSize) {
+    uint32_t maxConn = (s_option.connections > 1) ? s_option.connections : 1;
+    uint32_t maxRanges = (s_option.rangesPerRequest > 1) ? s_option.rangesPerRequest : 1;
+    uint32_t maxBytes = s_option.maxRangeBytes;
+#pragma omp critical (patch_tuner)
+    {
+        if(!s_option.adaptive) {
+            s_tuner.connections = maxConn;
+            s_tuner.rangesPerRequest = maxRanges;
+            s_tuner.maxRangeBytes = maxBytes;
+        } else if(s_tuner.connections == 0) {
+            s_tuner.connections = (maxConn + 1) / 2;
+            s_tuner.rangesPerRequest = (maxRanges + 1) / 2;
+            s_tuner.maxRangeBytes = maxBytes / 2;
+            s_tuner.throughput = 0;
         }
+        if(s_tuner.maxRangeBytes > 0 && s_tuner.maxRangeBytes < blockSize) {
+            s_tuner.maxRangeBytes = blockSize;
+        }
+        s_tunerStart = omp_get_wtime();
+        s_tunerBytes = 0;
+        s_missActive++;
+        *tuner = s_tuner;
+        Patch_tuneShare(tuner);
     }
+}
 
-    size_t restSize = fd->fileSize % fd->blockSize;
-    if(restSize > 0){
+static void Patch_tuneEnd() {
+#pragma omp critical (patch_tuner)
+    s_missActive--;
+}
 
-        fseek(f2, -restSize, SEEK_END);
-        fwrite(fd->restData, 1, restSize, f2);
+//one request done, ok 0 if failed or no progress; additive increase while throughput holds,
+//multiplicative decrease on failure
+static void Patch_tune(int ok, size_t bytes, uint32_t blockSize, patchTuner_t *tuner) {
+    if(!s_option.adaptive) return;
+    uint32_t maxConn = (s_option.connections > 1) ? s_option.connections : 1;
+    uint32_t maxRanges = (s_option.rangesPerRequest > 1) ? s_option.rangesPerRequest : 1;
+    uint32_t maxBytes = s_option.maxRangeBytes;
+    uint32_t stepBytes = (maxBytes / 8 > blockSize) ? maxBytes / 8 : blockSize;
+#pragma omp critical (patch_tuner)
+    {
+        patchTuner_t *t = &s_tuner;
+        double now = omp_get_wtime();
+        if(!ok) {
+            t->connections = (t->connections > 1) ? t->connections / 2 : 1;
+            t->rangesPerRequest = (t->rangesPerRequest > 1) ? t->rangesPerRequest / 2 : 1;
+            if(maxBytes > 0) {
+                t->maxRangeBytes = (t->maxRangeBytes / 2 > blockSize) ? t->maxRangeBytes / 2 : blockSize;
+            }
+            s_tunerStart = now;
+            s_tunerBytes = 0;
+        } else {
+            s_tunerBytes += bytes;
+            if(now - s_tunerStart >= PATCH_TUNE_WINDOW) {
+                uint32_t throughput = (uint32_t)(s_tunerBytes / (now - s_tunerStart));
+                if((uint64_t)throughput * 20 >= (uint64_t)t->throughput * 19) {
+                    //not worse than last window, probe more
+                    if(t->connections < maxConn) t->connections++;
+                    if(t->rangesPerRequest < maxRanges) t->rangesPerRequest++;
+                    if(maxBytes > 0) {
+                        t->maxRangeBytes = (t->maxRangeBytes + stepBytes < maxBytes) ? t->maxRangeBytes + stepBytes : maxBytes;
+                    }
+                } else if(t->connections > 1) {
+                    //last probe hurts, step back
+                    t->connections--;
+                }
+                t->throughput = throughput;
+                s_tunerStart = now;
+                s_tunerBytes = 0;
+            }
+        }
+        *tuner = *t;
+        Patch_tuneShare(tuner);
     }
-
-    free(buf);
-    fclose(f1);
-    fclose(f2);
-    LOGI("end %d\n", code);
-    return code;
 }
 
+#define PATCH_RETRY 10
+
 //continuous blocks, used for reduce http range frequency
 typedef struct combineblock_t {
     size_t pos; //block start position
     size_t got; //data fwrite size, used for HTTP retry
     size_t len; //block length
+    int retry; //left retry times without any data got
+    int busy; //requests fetching it, 2 if stolen by a faster mirror
+    uint32_t owner; //mirror of first request
+    strongCtx_t ctx; //digest of current block, [got - got % blockSize, got)
 } combineblock_t;
 
 static uint32_t Patch_missCombine(const diffResult_t *dr, combineblock_t *cb, uint32_t blockSize) {
@@ -105,49 +328,322 @@ static uint32_t Patch_missCombine(const diffResult_t *dr, combineblock_t *cb, ui
         LOGE("WTF: matchNum %d bigger than totalNum %d\n", dr->matchNum, dr->totalNum);
         return combineNum;
     }
-    int i;
-    uint32_t j;
-    for(i=0; i<dr->totalNum; ++i) {
-        if(dr->offsets[i] == -1) {
-            for(j=0; j < combineNum; ++j) {
-                if(cb[j].pos + cb[j].len == i * blockSize) {
-                    cb[j].len += blockSize;
-                    break;
-                }
-            }
-            if(j == combineNum) {
-                cb[combineNum].pos = i*blockSize;
-                cb[combineNum].len = blockSize;
-                ++combineNum;
-            }
+    //one more request costs as much as downloading gapBytes, so re-download smaller gaps
+    //64 bits, rtt * bandwidth overflows 32 bits size_t soon
+    const uint64_t gap = s_option.headerBytes + (uint64_t)s_option.rtt * s_option.bandwidth / 1000;
+    const size_t gapBytes = (gap < SIZE_MAX) ? (size_t)gap : SIZE_MAX;
+    size_t maxBytes = s_option.maxRangeBytes - s_option.maxRangeBytes % blockSize;
+    if(s_option.maxRangeBytes > 0 && maxBytes == 0) {
+        maxBytes = blockSize;
+    }
+
+    combineblock_t *last = NULL;
+    for(int32_t i=0; i<dr->totalNum; ++i) {
+        if(dr->offsets[i] != -1) continue;
+        size_t pos = (size_t)i * blockSize;
+        if(last && pos - (last->pos + last->len) <= gapBytes &&
+           (maxBytes == 0 || pos + blockSize - last->pos <= maxBytes)) {
+            last->len = pos + blockSize - last->pos;
+        } else {
+            last = &cb[combineNum++];
+            last->pos = pos;
+            last->got = 0;
+            last->len = blockSize;
+            last->retry = PATCH_RETRY;
+            last->busy = 0;
         }
     }
     LOGI("combineblocks Num = %d\n", combineNum);
     return combineNum;
 }
 
+//one of url's mirrors, scheduled by its measured speed
+typedef struct patchMirror_t {
+    const char *url; //ref to Patch_miss()
+    uint32_t speed; //one request's download speed, Bytes per second, 0 unknown
+    uint32_t busy; //running requests
+    uint32_t fails; //continuous failed requests
+    int dead; //1 never used again
+    char validator[HTTP_VALIDATOR_SIZE]; //mirrors may tag same file differently
+} patchMirror_t;
+
+//continuous failures to give up a mirror when others alive
+#define PATCH_MIRROR_FAILS 3
+
 typedef struct rangedata_t {
-    combineblock_t *cb; //ref to one Patch_miss()
-    FILE *file; //ref to one Patch_miss()
+    const fileDigest_t *fd; //ref to Patch_miss()
+    const diffResult_t *dr; //ref to Patch_miss()
+    combineblock_t *cb; //ref to Patch_miss()
+    uint32_t cbNum;
+    uint32_t done; //cb[0, done) got all
+    uint32_t rangesPerRequest; //1 if server not support multi ranges
+    patchTuner_t tuner; //copy of s_tuner, updated by Patch_tune()
+    patchMirror_t *mirrors; //url itself first
+    uint32_t mirrorNum;
+    fileWriter_t *dst; //ref to Patch_perform()
     char *basename; //ref to one Patch_miss()
+    size_t fileSize;
     size_t cacheBytes;
 } rangedata_t;
 
-static size_t Range_callback(void *data, size_t size, size_t nmemb, void *userp) {
-    rangedata_t *rd = (rangedata_t*)userp;
-    size_t realSize = size * nmemb;
-    fseek(rd->file, rd->cb->pos + rd->cb->got, SEEK_SET);
-    fwrite(data, size, nmemb, rd->file);
-    rd->cb->got += realSize;
-    rd->cacheBytes += realSize;
+//one connection's current request
+typedef struct rangeslot_t {
+    CURL *curl;
+    httpRange_t hr;
+    rangedata_t *rd; //ref to Patch_miss()
+    uint32_t *batch; //index of rd->cb
+    size_t *batchGot; //cb.got before request
+    uint32_t batchNum;
+    uint32_t mirror; //index of rd->mirrors
+    UT_string *range; //requested ranges, kept until request done
+} rangeslot_t;
+
+static size_t Range_callback(size_t offset, const void *data, size_t size, void *userp) {
+    rangeslot_t *rs = (rangeslot_t*)userp;
+    rangedata_t *rd = rs->rd;
+    if(offset + size > rd->fileSize) {
+        LOGE("range data %lu-%lu out of file\n", (unsigned long)offset, (unsigned long)(offset + size));
+        return 0;
+    }
+    //server may reorder or merge ranges, so got grows only with continuous data.
+    //only [next, end) is written: bytes before next are checked already, maybe from
+    //another mirror fetching the same stolen block, never overwritten by a slower request
+    const uint32_t blockSize = rd->fd->blockSize;
+    for(uint32_t i=0; i<rs->batchNum; ++i) {
+        combineblock_t *cb = &rd->cb[rs->batch[i]];
+        size_t next = cb->pos + cb->got;
+        if(cb->got < cb->len && offset <= next && next < offset + size) {
+            size_t end = offset + size;
+            if(end > cb->pos + cb->len) end = cb->pos + cb->len;
+            //verify every block once complete, cb->pos is block aligned.
+            //gaps combined in are local already, maybe without known digests, skipped
+            while(next < end) {
+                size_t blockEnd = next - next % blockSize + blockSize;
+                size_t n = ((end < blockEnd) ? end : blockEnd) - next;
+                if(rd->dr->offsets[next / blockSize] != -1) {
+                    rd->cacheBytes += n;
+                    next += n;
+                    continue;
+                }
+                if(0 != Util_writerWrite(rd->dst, next, (const uint8_t*)data + (next - offset), n)) {
+                    return 0;
+                }
+                if(next % blockSize == 0) {
+                    Digest_CalcStrong_Init(&cb->ctx);
+                }
+                Digest_CalcStrong_Update(&cb->ctx, (const uint8_t*)data + (next - offset), n);
+                rd->cacheBytes += n;
+                next += n;
+                if(next == blockEnd) {
+                    uint8_t hash[CRS_STRONG_DIGEST_SIZE];
+                    Digest_CalcStrong_Final(&cb->ctx, hash);
+                    if(0 != memcmp(hash, rd->fd->blockDigest[next / blockSize - 1].strong, CRS_STRONG_DIGEST_SIZE)) {
+                        LOGW("block %lu digest wrong, fetch again\n", (unsigned long)(next / blockSize - 1));
+                        rd->cacheBytes -= blockSize;
+                        next -= blockSize;
+                        cb->retry--;
+                        break;
+                    }
+                }
+            }
+            cb->got = next - cb->pos;
+        }
+    }
     int isCancel = crs_callback_patch(rd->basename, rd->cacheBytes, 0, 0);
-    return (isCancel == 0) ? realSize : 0;
+    return (isCancel == 0) ? size : 0;
+}
+
+//unknown speed as fastest known, so every mirror gets tried
+static uint32_t Patch_mirrorSpeed(const rangedata_t *rd, uint32_t m) {
+    if(rd->mirrors[m].speed > 0) return rd->mirrors[m].speed;
+    uint32_t speed = 1;
+    for(uint32_t i=0; i<rd->mirrorNum; ++i) {
+        if(rd->mirrors[i].speed > speed) speed = rd->mirrors[i].speed;
+    }
+    return speed;
+}
+
+//alive mirror with least running requests per speed, so work in proportion to speed
+static uint32_t Patch_mirrorPick(const rangedata_t *rd) {
+    uint32_t best = 0;
+    int found = 0;
+    for(uint32_t i=0; i<rd->mirrorNum; ++i) {
+        if(rd->mirrors[i].dead) continue;
+        if(!found || (uint64_t)(rd->mirrors[i].busy + 1) * Patch_mirrorSpeed(rd, best) <
+                     (uint64_t)(rd->mirrors[best].busy + 1) * Patch_mirrorSpeed(rd, i)) {
+            best = i;
+            found = 1;
+        }
+    }
+    return best;
+}
+
+static uint32_t Patch_mirrorAlive(const rangedata_t *rd) {
+    uint32_t alive = 0;
+    for(uint32_t i=0; i<rd->mirrorNum; ++i) {
+        if(!rd->mirrors[i].dead) alive++;
+    }
+    return alive;
+}
+
+//no idle combineblock left, fetch the biggest rest of a slower mirror's one again
+static int32_t Patch_missSteal(const rangedata_t *rd, uint32_t mirror) {
+    int32_t steal = -1;
+    size_t rest = 0;
+    uint32_t speed = Patch_mirrorSpeed(rd, mirror);
+    for(uint32_t i=rd->done; i<rd->cbNum; ++i) {
+        const combineblock_t *cb = &rd->cb[i];
+        if(cb->busy != 1 || cb->got >= cb->len || cb->owner == mirror) continue;
+        if(Patch_mirrorSpeed(rd, cb->owner) >= speed) continue;
+        if(cb->len - cb->got > rest) {
+            rest = cb->len - cb->got;
+            steal = i;
+        }
+    }
+    return steal;
+}
+
+//pick idle combineblocks for one request, return ranges count
+static uint32_t Patch_missBatch(rangedata_t *rd, rangeslot_t *rs) {
+    UT_string *range = rs->range;
+    while(rd->done < rd->cbNum && rd->cb[rd->done].got >= rd->cb[rd->done].len) {
+        rd->done++;
+    }
+    rs->batchNum = 0;
+    rs->mirror = Patch_mirrorPick(rd);
+    utstring_clear(range);
+    uint32_t rangesPerRequest = rd->rangesPerRequest;
+    if(rd->tuner.rangesPerRequest > 0 && rd->tuner.rangesPerRequest < rangesPerRequest) {
+        rangesPerRequest = rd->tuner.rangesPerRequest;
+    }
+    const uint32_t blockSize = rd->fd->blockSize;
+    for(uint32_t i=rd->done; i<rd->cbNum && rs->batchNum < rangesPerRequest; ++i) {
+        combineblock_t *cb = &rd->cb[i];
+        if(cb->busy || cb->got >= cb->len) continue;
+        //tuned range length from current block start, rest in later requests
+        size_t end = cb->len;
+        if(rd->tuner.maxRangeBytes > 0 && cb->got - cb->got % blockSize + rd->tuner.maxRangeBytes < end) {
+            end = cb->got - cb->got % blockSize + rd->tuner.maxRangeBytes;
+        }
+        long rangeFrom = cb->pos + cb->got;
+        long rangeTo = cb->pos + end - 1;
+        utstring_printf(range, (rs->batchNum == 0) ? "%ld-%ld" : ",%ld-%ld", rangeFrom, rangeTo);
+        cb->busy = 1;
+        cb->owner = rs->mirror;
+        rs->batch[rs->batchNum] = i;
+        rs->batchGot[rs->batchNum] = cb->got;
+        rs->batchNum++;
+    }
+    if(rs->batchNum == 0 && Patch_mirrorAlive(rd) > 1) {
+        int32_t i = Patch_missSteal(rd, rs->mirror);
+        if(i >= 0) {
+            combineblock_t *cb = &rd->cb[i];
+            utstring_printf(range, "%ld-%ld", (long)(cb->pos + cb->got), (long)(cb->pos + cb->len - 1));
+            cb->busy++;
+            rs->batch[0] = i;
+            rs->batchGot[0] = cb->got;
+            rs->batchNum = 1;
+            LOGI("steal %ld-%ld from mirror %u to %u\n", (long)(cb->pos + cb->got), (long)(cb->pos + cb->len - 1), cb->owner, rs->mirror);
+            cb->owner = rs->mirror; //stolen once only
+        }
+    }
+    if(rs->batchNum > 0) {
+        rd->mirrors[rs->mirror].busy++;
+    }
+    return rs->batchNum;
+}
+
+//request not needed any more since other requests got all its ranges, return 1 if released
+static int Patch_missCancel(rangedata_t *rd, rangeslot_t *rs) {
+    for(uint32_t i=0; i<rs->batchNum; ++i) {
+        const combineblock_t *cb = &rd->cb[rs->batch[i]];
+        if(cb->got < cb->len) return 0;
+    }
+    for(uint32_t i=0; i<rs->batchNum; ++i) {
+        rd->cb[rs->batch[i]].busy--;
+    }
+    rd->mirrors[rs->mirror].busy--;
+    rs->batchNum = 0;
+    return 1;
+}
+
+//release request's combineblocks, return CRS_OK to go on
+static CRScode Patch_missDone(rangedata_t *rd, rangeslot_t *rs, CURLcode curlcode) {
+    CRScode code = CRS_OK;
+    int bad = rs->hr.changed || rs->hr.mismatch; //same request would go wrong again
+    if(rs->hr.isWhole && !bad && rd->rangesPerRequest > 1) {
+        LOGW("multi ranges not supported, fallback to single range\n");
+        rd->rangesPerRequest = 1;
+        curlcode = CURLE_OK; //not a network error, no retry cost
+    }
+    if(curlcode != CURLE_OK) {
+        LOGE("curl code %d\n", curlcode);
+    }
+    int ok = (curlcode == CURLE_OK);
+    size_t bytes = 0;
+    for(uint32_t i=0; i<rs->batchNum; ++i) {
+        combineblock_t *cb = &rd->cb[rs->batch[i]];
+        if(cb->got > rs->batchGot[i]) {
+            bytes += cb->got - rs->batchGot[i];
+        } else if(cb->got < cb->len) {
+            ok = 0;
+        }
+    }
+    Patch_tune(ok, bytes, rd->fd->blockSize, &rd->tuner);
+
+    //mirror's speed and health
+    patchMirror_t *m = &rd->mirrors[rs->mirror];
+    m->busy--;
+    int failover = 0; //blocks not blamed for a given up mirror
+    if(ok) {
+        double total = 0;
+        curl_easy_getinfo(rs->curl, CURLINFO_TOTAL_TIME, &total);
+        if(total > 0 && bytes > 0) {
+            uint32_t speed = (uint32_t)(bytes / total);
+            m->speed = (m->speed == 0) ? speed : (uint32_t)(((uint64_t)m->speed * 3 + speed) / 4);
+        }
+        m->fails = 0;
+    } else if(Patch_mirrorAlive(rd) > 1) {
+        m->fails++;
+        if(bad || curlcode == CURLE_HTTP_RETURNED_ERROR || m->fails >= PATCH_MIRROR_FAILS) {
+            LOGW("mirror %s given up\n", m->url);
+            m->dead = 1;
+        }
+        failover = m->dead;
+    }
+
+    for(uint32_t i=0; i<rs->batchNum; ++i) {
+        combineblock_t *cb = &rd->cb[rs->batch[i]];
+        cb->busy--;
+        if(cb->got >= cb->len) continue;
+        if(cb->busy > 0 || failover) continue; //another request still on it, or another mirror next
+        if(cb->got > rs->batchGot[i] && cb->retry > 0) { //got some verified, go on
+            cb->retry = PATCH_RETRY;
+            continue;
+        }
+        switch(bad ? CURLE_HTTP_RETURNED_ERROR : curlcode) {
+        case CURLE_HTTP_RETURNED_ERROR:
+            LOGE("HTTP request/response header wrong!\n");
+            cb->retry = 0;
+            break;
+        case CURLE_OPERATION_TIMEDOUT: //timeout, retry forever
+            break;
+        default: //includes server answered less ranges than requested
+            cb->retry--;
+            break;
+        }
+        if(cb->retry <= 0) {
+            code = CRS_HTTP_ERROR;
+        }
+    }
+    rs->batchNum = 0;
+    return code;
 }
 
-static CRScode Patch_miss(const char *srcFilename, const char *dstFilename, const char *url,
+static CRScode Patch_miss(const char *srcFilename, fileWriter_t *dst, const char *url,
                           const fileDigest_t *fd, const diffResult_t *dr) {
     LOGI("begin\n");
-    if(!srcFilename || !dstFilename || !fd || !dr) {
+    if(!srcFilename || !dst || !fd || !dr) {
         LOGE("end %d\n", CRS_PARAM_ERROR);
         return CRS_PARAM_ERROR;
     }
@@ -158,85 +654,431 @@ static CRScode Patch_miss(const char *srcFilename, const char *dstFilename, cons
         return CRS_OK;
     }
 
-    FILE *f = fopen(dstFilename, "rb+");
-    if(!f){
-        LOGE("%s\n", dstFilename);
-        LOGE("end fopen error %s\n", strerror(errno));
-        return CRS_FILE_ERROR;
-    }
-
     //combine continuous blocks, no more than missNum
     combineblock_t *cb = calloc(missNum, sizeof(combineblock_t) );
     uint32_t cbNum = Patch_missCombine(dr, cb, fd->blockSize);
 
     CRScode code = CRS_OK;
     rangedata_t rd;
-    rd.file = f;
-    rd.cacheBytes = fd->fileSize - (missNum * fd->blockSize);
+    rd.fd = fd;
+    rd.dr = dr;
+    rd.cb = cb;
+    rd.cbNum = cbNum;
+    rd.done = 0;
+    rd.rangesPerRequest = (s_option.rangesPerRequest > 1) ? s_option.rangesPerRequest : 1;
+    Patch_tuneBegin(&rd.tuner, fd->blockSize);
+    char **urls = NULL;
+    rd.mirrorNum = HTTP_mirrorExpand(url, &urls);
+    rd.mirrors = calloc(rd.mirrorNum, sizeof(patchMirror_t));
+    for(uint32_t i=0; i<rd.mirrorNum; ++i) {
+        rd.mirrors[i].url = urls[i];
+    }
+    rd.dst = dst;
+    rd.fileSize = fd->fileSize;
+    rd.cacheBytes = fd->fileSize;
+    for(uint32_t i=0; i< cbNum; ++i) {
+        rd.cacheBytes -= cb[i].len; //combined ranges may include matched gaps
+    }
 
     //Some compiler maybe change basename() param
     //Do not free(basename) since it maybe inside of fullname
     char *tempname = strdup(srcFilename);
     rd.basename = basename(tempname);
-    CURL *curl = curl_easy_init();
-    for(uint32_t i=0; i< cbNum; ++i) {
-        rd.cb = &cb[i];
-        char range[32];
-        long rangeFrom;
-        long rangeTo;
-
-        int retry = 10;
-        while(retry-- > 0) {
-            rangeFrom = cb[i].pos + cb[i].got;
-            rangeTo = cb[i].pos + cb[i].len - 1;
-            snprintf(range, 32, "%ld-%ld", rangeFrom, rangeTo);
-
-            if(rangeFrom >= rangeTo) {
-                LOGE("range request %ld-%ld wrong\n", rangeFrom, rangeTo);
-                LOGE("This should not happend! But continue NextBlock\n");
-                code = CRS_OK;
-                break;
+
+    uint32_t slotNum = (s_option.connections > 1) ? s_option.connections : 1;
+    if(slotNum > cbNum) slotNum = cbNum;
+    rangeslot_t *slots = calloc(slotNum, sizeof(rangeslot_t));
+
+    CURLM *multi = HTTP_multi_acquire(slotNum);
+    for(uint32_t i=0; i<slotNum; ++i) {
+        slots[i].curl = HTTP_easy_acquire();
+        slots[i].hr.callback = Range_callback;
+        slots[i].hr.data = &slots[i];
+        slots[i].rd = &rd;
+        slots[i].batch = malloc(sizeof(uint32_t) * rd.rangesPerRequest);
+        slots[i].batchGot = malloc(sizeof(size_t) * rd.rangesPerRequest);
+        utstring_new(slots[i].range);
+    }
+
+    //slots as max connections, only tuner.connections of them busy
+    uint32_t running = 0;
+    while(code == CRS_OK) {
+        for(uint32_t i=0; i<slotNum && running < rd.tuner.connections; ++i) {
+            if(slots[i].batchNum == 0 && Patch_missBatch(&rd, &slots[i]) > 0) {
+                slots[i].hr.validator = rd.mirrors[slots[i].mirror].validator;
+                slots[i].hr.total = fd->fileSize;
+                HTTP_Range_setopt(slots[i].curl, rd.mirrors[slots[i].mirror].url, utstring_body(slots[i].range), &slots[i].hr);
+                curl_easy_setopt(slots[i].curl, CURLOPT_PRIVATE, (void*)&slots[i]);
+                curl_multi_add_handle(multi, slots[i].curl);
+                running++;
             }
+        }
+        if(running == 0) break; //all done
 
-            CURLcode curlcode = HTTP_Range(curl, url, range, (void*)Range_callback, &rd);
+        int still = 0;
+        curl_multi_perform(multi, &still);
 
-            switch(curlcode) {
-            case CURLE_OK:
-                code = CRS_OK;
-                break;
-            case CURLE_HTTP_RETURNED_ERROR:
-                LOGE("HTTP request/response header wrong!\n");
-                retry = -1;
-                code = CRS_HTTP_ERROR;
-                break;
-            case CURLE_OPERATION_TIMEDOUT: //timeout
-                retry++;
-                code = CRS_HTTP_ERROR;
-                break;
-            default:
+        CURLMsg *msg = NULL;
+        int left = 0;
+        while((msg = curl_multi_info_read(multi, &left))) {
+            if(msg->msg != CURLMSG_DONE) continue;
+            rangeslot_t *rs = NULL;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&rs);
+            CURLcode curlcode = msg->data.result;
+            curl_multi_remove_handle(multi, rs->curl);
+            running--;
+            if(curlcode == CURLE_OK) {
+                HTTP_measure(rs->curl);
+            }
+            if(CRS_OK != Patch_missDone(&rd, rs, curlcode)) {
                 code = CRS_HTTP_ERROR;
-                break;
             }
-
-            if(CRS_OK == code) { //got it
-                break;
-            } else {
-                LOGE("curl code %d\n", curlcode);
+        }
+        //stolen ranges done by others, stop stragglers
+        for(uint32_t i=0; i<slotNum; ++i) {
+            if(slots[i].batchNum > 0 && Patch_missCancel(&rd, &slots[i])) {
+                curl_multi_remove_handle(multi, slots[i].curl);
+                running--;
             }
-        }//end of while
+        }
+
+        if(still > 0) {
+            curl_multi_wait(multi, NULL, 0, 1000, NULL);
+        }
+    }
+
+    for(uint32_t i=0; i<slotNum; ++i) {
+        if(slots[i].batchNum > 0) {
+            curl_multi_remove_handle(multi, slots[i].curl);
+        }
+        HTTP_easy_release(slots[i].curl);
+        HTTP_Range_cleanup(&slots[i].hr);
+        utstring_free(slots[i].range);
+        free(slots[i].batch);
+        free(slots[i].batchGot);
+    }
+    HTTP_multi_release(multi);
 
-    }//end of for
+    for(uint32_t i=0; i<cbNum; ++i) {
+        if(cb[i].got < cb[i].len) {
+            code = CRS_HTTP_ERROR;
+            break;
+        }
+    }
+
+    Patch_tuneEnd();
+    patchTuner_t tuner;
+    Patch_getTuner(&tuner);
+    LOGI("tuner connections %u rangesPerRequest %u maxRangeBytes %u throughput %uB/s rtt %ums\n",
+         tuner.connections, tuner.rangesPerRequest, tuner.maxRangeBytes, tuner.throughput, tuner.rtt);
+
+    for(uint32_t i=0; i<rd.mirrorNum; ++i) {
+        LOGI("mirror %s speed %uB/s%s\n", rd.mirrors[i].url, rd.mirrors[i].speed, rd.mirrors[i].dead ? " dead" : "");
+    }
 
-    curl_easy_cleanup(curl);
+    free(rd.mirrors);
+    HTTP_mirrorFree(urls, rd.mirrorNum);
+    free(slots);
     free(tempname);
     free(cb);
+    LOGI("end %d\n", code);
+    return code;
+}
+
+//missing block same as another block in dst, copied from it instead of download
+#define PATCH_DUP (-3)
+
+typedef struct patchDup_t {
+    uint8_t         strong[CRS_STRONG_DIGEST_SIZE]; //key
+    int32_t         seq; //block in dst, cached or first missing one
+    UT_hash_handle  hh;
+} patchDup_t;
+
+//mark missing blocks duplicated as PATCH_DUP, return their source block index, NULL if none
+static int32_t* Patch_dedup(const fileDigest_t *fd, diffResult_t *dr) {
+    patchDup_t *dups = NULL, *item = NULL, *tmp = NULL;
+    int32_t *rep = NULL;
+    int32_t dupNum = 0;
+    //cached blocks first, they are in dst already
+    for(int pass=0; pass<2; ++pass) {
+        for(int32_t i=0; i<dr->totalNum; ++i) {
+            if(dr->offsets[i] != ((pass == 0) ? -2 : -1)) continue;
+            const uint8_t *strong = fd->blockDigest[i].strong;
+            HASH_FIND(hh, dups, strong, CRS_STRONG_DIGEST_SIZE, item);
+            if(!item) {
+                item = calloc(1, sizeof(patchDup_t));
+                memcpy(item->strong, strong, CRS_STRONG_DIGEST_SIZE);
+                item->seq = i;
+                HASH_ADD(hh, dups, strong, CRS_STRONG_DIGEST_SIZE, item);
+            } else if(pass == 1) {
+                if(!rep) {
+                    rep = malloc(sizeof(int32_t) * dr->totalNum);
+                }
+                rep[i] = item->seq;
+                dr->offsets[i] = PATCH_DUP;
+                dr->cacheNum++; //no network bytes
+                dupNum++;
+            }
+        }
+    }
+    HASH_ITER(hh, dups, item, tmp) {
+        HASH_DEL(dups, item);
+        free(item);
+    }
+    LOGI("duplicate missing blocks Num = %d\n", dupNum);
+    return rep;
+}
+
+//fill PATCH_DUP blocks from their verified copies in dst, checked again as copied
+static CRScode Patch_dedupCopy(fileWriter_t *w, const char *filename, const fileDigest_t *fd,
+                               const diffResult_t *dr, const int32_t *rep) {
+    if(!rep) return CRS_OK;
+    FILE *f = fopen(filename, "rb");
+    if(!f) {
+        LOGE("fopen error %s\n", strerror(errno));
+        return CRS_FILE_ERROR;
+    }
+    setvbuf(f, NULL, _IONBF, 0); //read what just written
+    uint8_t *buf = malloc(fd->blockSize);
+    uint8_t hash[CRS_STRONG_DIGEST_SIZE];
+    CRScode code = CRS_OK;
+    for(int32_t i=0; i<dr->totalNum && code == CRS_OK; ++i) {
+        if(dr->offsets[i] != PATCH_DUP) continue;
+        if(0 != fseek(f, (size_t)rep[i] * fd->blockSize, SEEK_SET) || fd->blockSize != fread(buf, 1, fd->blockSize, f)) {
+            code = CRS_FILE_ERROR;
+            break;
+        }
+        Digest_CalcStrong_Data(buf, fd->blockSize, hash);
+        if(0 != memcmp(hash, fd->blockDigest[i].strong, CRS_STRONG_DIGEST_SIZE)) {
+            LOGE("duplicate source block %d changed\n", rep[i]);
+            code = CRS_BUG;
+        } else if(0 != Util_writerWrite(w, (size_t)i * fd->blockSize, buf, fd->blockSize)) {
+            code = CRS_FILE_ERROR;
+        }
+    }
+    free(buf);
     fclose(f);
+    return code;
+}
+
+//block of one repeated byte, synthesized without network
+#define PATCH_CONST (-4)
+
+//mark missing blocks of one repeated byte (and matched zero blocks if zeroMatched) as PATCH_CONST,
+//return every block's byte value, NULL if none
+static uint8_t* Patch_constant(const fileDigest_t *fd, diffResult_t *dr, int zeroMatched) {
+    //weak and strong digests of the 256 constant blocks, strong computed on demand
+    uint32_t weaks[256];
+    uint8_t strongs[256][CRS_STRONG_DIGEST_SIZE];
+    uint8_t known[256] = {0};
+    uint8_t *buf = malloc(fd->blockSize);
+    for(int v=0; v<256; ++v) {
+        memset(buf, v, fd->blockSize);
+        Digest_CalcWeak_Data(buf, fd->blockSize, &weaks[v]);
+    }
+    uint8_t *fill = NULL;
+    int32_t constNum = 0;
+    for(int32_t i=0; i<dr->totalNum; ++i) {
+        int32_t off = dr->offsets[i];
+        if(off != -1 && !(zeroMatched && off >= 0)) continue;
+        for(int v=0; v<256; ++v) {
+            if(off >= 0 && v > 0) break; //matched ones copy cheap enough unless sparse zero
+            if(fd->blockDigest[i].weak != weaks[v]) continue;
+            if(!known[v]) {
+                memset(buf, v, fd->blockSize);
+                Digest_CalcStrong_Data(buf, fd->blockSize, strongs[v]);
+                known[v] = 1;
+            }
+            if(0 != memcmp(fd->blockDigest[i].strong, strongs[v], CRS_STRONG_DIGEST_SIZE)) continue;
+            if(!fill) {
+                fill = malloc(dr->totalNum);
+            }
+            fill[i] = v;
+            if(off >= 0) dr->matchNum--;
+            dr->offsets[i] = PATCH_CONST;
+            dr->cacheNum++; //no network bytes
+            constNum++;
+            break;
+        }
+    }
+    free(buf);
+    LOGI("constant blocks Num = %d\n", constNum);
+    return fill;
+}
+
+//constant blocks need no check, Patch_constant compared their strong digest with the fill data's
+static CRScode Patch_constantFill(fileWriter_t *w, const fileDigest_t *fd, const diffResult_t *dr, const uint8_t *fill) {
+    if(!fill) return CRS_OK;
+    for(int32_t i=0; i<dr->totalNum; ++i) {
+        if(dr->offsets[i] != PATCH_CONST) continue;
+        if(0 != Util_writerFill(w, (size_t)i * fd->blockSize, fill[i], fd->blockSize, s_option.sparse)) {
+            return CRS_FILE_ERROR;
+        }
+    }
+    return CRS_OK;
+}
+
+//block in another local file, copied from it instead of download
+#define PATCH_BORROW (-5)
+
+//mark borrow blocks still missing as PATCH_BORROW
+static void Patch_borrow(diffResult_t *dr, const patchBorrow_t *borrow, uint32_t borrowNum) {
+    int32_t borrowed = 0;
+    for(uint32_t k=0; k<borrowNum; ++k) {
+        int32_t i = borrow[k].seq;
+        if(i < 0 || i >= dr->totalNum || dr->offsets[i] != -1) continue;
+        dr->offsets[i] = PATCH_BORROW;
+        dr->cacheNum++; //no network bytes
+        borrowed++;
+    }
+    LOGI("borrow blocks Num = %d\n", borrowed);
+}
+
+//copy PATCH_BORROW blocks, the ones unreadable or changed go back to missing
+static CRScode Patch_borrowCopy(fileWriter_t *w, const fileDigest_t *fd, diffResult_t *dr,
+                                const patchBorrow_t *borrow, uint32_t borrowNum) {
+    if(borrowNum == 0) return CRS_OK;
+    uint8_t *buf = malloc(fd->blockSize);
+    uint8_t strong[CRS_STRONG_DIGEST_SIZE];
+    const char *opened = NULL;
+    FILE *f = NULL;
+    CRScode code = CRS_OK;
+    int32_t failNum = 0;
+    for(uint32_t k=0; k<borrowNum && code == CRS_OK; ++k) {
+        int32_t i = borrow[k].seq;
+        if(i < 0 || i >= dr->totalNum || dr->offsets[i] != PATCH_BORROW) continue;
+        if(!opened || 0 != strcmp(opened, borrow[k].filename)) {
+            if(f) fclose(f);
+            f = fopen(borrow[k].filename, "rb");
+            opened = borrow[k].filename;
+        }
+        int ok = (f && 0 == fseek(f, borrow[k].offset, SEEK_SET) && fd->blockSize == fread(buf, 1, fd->blockSize, f));
+        if(ok) {
+            Digest_CalcStrong_Data(buf, fd->blockSize, strong);
+            ok = (0 == memcmp(strong, fd->blockDigest[i].strong, CRS_STRONG_DIGEST_SIZE));
+        }
+        if(!ok) {
+            dr->offsets[i] = -1;
+            dr->cacheNum--;
+            failNum++;
+        } else if(0 != Util_writerWrite(w, (size_t)i * fd->blockSize, buf, fd->blockSize)) {
+            code = CRS_FILE_ERROR;
+        }
+    }
+    if(f) fclose(f);
+    free(buf);
+    if(failNum > 0) {
+        LOGI("borrow blocks %d changed, download them\n", failNum);
+    }
+    return code;
+}
+
+//dr after Patch_constant and Patch_dedup, as Patch_perform does
+static void Patch_planLocal(const fileDigest_t *fd, const diffResult_t *dr, patchPlan_t *plan) {
+    memset(plan, 0, sizeof(patchPlan_t));
+    httpLink_t link;
+    HTTP_getLink(&link);
+    plan->rtt = (link.rtt > 0) ? link.rtt : s_option.rtt;
+    plan->bandwidth = (link.bandwidth > 0) ? link.bandwidth : s_option.bandwidth;
+    if(plan->bandwidth == 0) plan->bandwidth = 1;
+    uint32_t copySpeed = (s_option.copySpeed > 0) ? s_option.copySpeed : 1;
+    uint32_t rangesPerRequest = (s_option.rangesPerRequest > 1) ? s_option.rangesPerRequest : 1;
+    uint32_t connections = (s_option.connections > 1) ? s_option.connections : 1;
+
+    int missNum = dr->totalNum - dr->matchNum - dr->cacheNum;
+    int dupNum = 0;
+    for(int32_t i=0; i<dr->totalNum; ++i) {
+        if(dr->offsets[i] == PATCH_DUP || dr->offsets[i] == PATCH_BORROW) dupNum++;
+    }
+    plan->copyBytes = (size_t)(dr->matchNum + dupNum) * fd->blockSize;
+    if(missNum > 0) {
+        combineblock_t *cb = calloc(missNum, sizeof(combineblock_t));
+        uint32_t cbNum = Patch_missCombine(dr, cb, fd->blockSize);
+        size_t rangeBytes = 0;
+        for(uint32_t i=0; i<cbNum; ++i) {
+            rangeBytes += cb[i].len;
+        }
+        free(cb);
+        plan->requests = (cbNum + rangesPerRequest - 1) / rangesPerRequest;
+        plan->deltaBytes = rangeBytes + (size_t)plan->requests * s_option.headerBytes;
+    }
+    //requests of different connections overlap their round trips
+    uint32_t rounds = (plan->requests + connections - 1) / connections;
+    double delta = (double)rounds * plan->rtt + plan->deltaBytes * 1000.0 / plan->bandwidth
+                 + plan->copyBytes * 1000.0 / copySpeed;
+    double full = plan->rtt + (fd->fileSize + s_option.headerBytes) * 1000.0 / plan->bandwidth;
+    plan->deltaCost = (delta < UINT32_MAX) ? (uint32_t)delta : UINT32_MAX;
+    plan->fullCost = (full < UINT32_MAX) ? (uint32_t)full : UINT32_MAX;
+    plan->strategy = (s_option.planner && missNum > 0 && plan->fullCost < plan->deltaCost) ?
+                PATCH_STRATEGY_FULL : PATCH_STRATEGY_DELTA;
+    LOGI("plan %s delta %ums (%d requests, %luBytes, copy %luBytes) full %ums, rtt %ums bandwidth %uB/s\n",
+         (plan->strategy == PATCH_STRATEGY_FULL) ? "full" : "delta", plan->deltaCost, plan->requests,
+         (unsigned long)plan->deltaBytes, (unsigned long)plan->copyBytes, plan->fullCost, plan->rtt, plan->bandwidth);
+}
+
+void Patch_plan(const fileDigest_t *fd, const diffResult_t *dr, patchPlan_t *plan) {
+    if(!fd || !dr || !plan) return;
+    if(dr->fine && dr->fineDr) {
+        fd = dr->fine;
+        dr = dr->fineDr;
+    }
+    diffResult_t local = *dr;
+    local.offsets = malloc(sizeof(int32_t) * (dr->totalNum > 0 ? dr->totalNum : 1));
+    memcpy(local.offsets, dr->offsets, sizeof(int32_t) * dr->totalNum);
+    free(Patch_constant(fd, &local, s_option.sparse));
+    free(Patch_dedup(fd, &local));
+    Patch_planLocal(fd, &local, plan);
+    free(local.offsets);
+}
+
+//whole file by one streaming download, then verified
+static CRScode Patch_full(const char *dstFilename, const char *url, const fileDigest_t *fd, const char *name) {
+    LOGI("begin\n");
+    //HTTP_File resumes from current size, dst holds old cache
+    FILE *f = fopen(dstFilename, "wb");
+    if(!f) {
+        LOGE("dst file create fail %s\n", strerror(errno));
+        return CRS_FILE_ERROR;
+    }
+    fclose(f);
+    CRScode code = HTTP_File(url, dstFilename, PATCH_RETRY, name);
+    if(code == CRS_OK) {
+        uint8_t hash[CRS_STRONG_DIGEST_SIZE];
+        Digest_CalcFile(dstFilename, fd, hash);
+        code = (0 == memcmp(hash, fd->fileDigest, CRS_STRONG_DIGEST_SIZE)) ? CRS_OK : CRS_BUG ;
+    }
     LOGI("end %d\n", code);
     return code;
 }
 
+//coarseDr with its matched blocks whose refined ones Patch_match turned missing, missing too;
+//NULL if none
+static diffResult_t* Patch_refineFallback(const diffResult_t *coarseDr, const diffResult_t *local, uint32_t ratio) {
+    diffResult_t *back = NULL;
+    for(int32_t c=0; c<coarseDr->totalNum; ++c) {
+        if(coarseDr->offsets[c] < 0 || local->offsets[(size_t)c * ratio] != -1) continue;
+        if(!back) {
+            back = diffResult_malloc();
+            back->totalNum = coarseDr->totalNum;
+            back->matchNum = coarseDr->matchNum;
+            back->cacheNum = coarseDr->cacheNum;
+            back->offsets = malloc(sizeof(int32_t) * coarseDr->totalNum);
+            memcpy(back->offsets, coarseDr->offsets, sizeof(int32_t) * coarseDr->totalNum);
+        }
+        back->offsets[c] = -1;
+        back->matchNum--;
+    }
+    return back;
+}
+
 CRScode Patch_perform(const char *srcFilename, const char *dstFilename, const char *url,
                       const fileDigest_t *fd, const diffResult_t *dr) {
+    return Patch_performBorrow(srcFilename, dstFilename, url, fd, dr, NULL, 0);
+}
+
+CRScode Patch_performBorrow(const char *srcFilename, const char *dstFilename, const char *url,
+                            const fileDigest_t *fd, const diffResult_t *dr,
+                            const patchBorrow_t *borrow, uint32_t borrowNum) {
     LOGI("begin\n");
 
     if(!srcFilename || !dstFilename || !url || !fd || !dr) {
@@ -244,9 +1086,65 @@ CRScode Patch_perform(const char *srcFilename, const char *dstFilename, const ch
         return CRS_PARAM_ERROR;
     }
 
+    //refined plan patches by smaller blocks, whose digests are known under missing blocks only,
+    //so Patch_match checks local blocks under matched coarse ones by coarse digests, and the whole
+    //file is checked by coarse fd at last. those changed have no digests to download by, then
+    //patched again by coarse blocks
+    const fileDigest_t *coarse = fd;
+    const diffResult_t *coarseDr = dr;
+    const patchBorrow_t *coarseBorrow = borrow;
+    const uint32_t coarseBorrowNum = borrowNum;
+    diffResult_t *fallback = NULL;
+    patchBorrow_t *fineBorrow = NULL;
+    if(dr->fine && dr->fineDr) {
+        uint32_t k = fd->blockSize / dr->fine->blockSize;
+        fineBorrow = malloc(sizeof(patchBorrow_t) * (borrowNum * k + 1));
+        for(uint32_t b=0; b<borrowNum; ++b) {
+            for(uint32_t j=0; j<k; ++j) {
+                fineBorrow[b * k + j].filename = borrow[b].filename;
+                fineBorrow[b * k + j].offset = borrow[b].offset + (size_t)j * dr->fine->blockSize;
+                fineBorrow[b * k + j].seq = borrow[b].seq * k + j;
+            }
+        }
+        borrow = fineBorrow;
+        borrowNum *= k;
+        fd = dr->fine;
+        dr = dr->fineDr;
+    }
+
+    //constant blocks synthesized locally, other files' blocks borrowed, then same blocks downloaded only once
+    diffResult_t local = *dr;
+    local.offsets = malloc(sizeof(int32_t) * (dr->totalNum > 0 ? dr->totalNum : 1));
+    memcpy(local.offsets, dr->offsets, sizeof(int32_t) * dr->totalNum);
+    uint8_t *fill = Patch_constant(fd, &local, s_option.sparse);
+    Patch_borrow(&local, borrow, borrowNum);
+    int32_t *rep = Patch_dedup(fd, &local);
+    patchPlan_t plan;
+    Patch_planLocal(fd, &local, &plan);
+
+    char *tempname = strdup(srcFilename);
+    char *name = basename(tempname);
+
     CRScode code = CRS_OK;
     do {
-        if(0 != access(srcFilename, F_OK)) {
+        //block digests of a tree must be the file's, checked before any block trusts them
+        if(fd == coarse && fd->digestMode == DIGEST_MODE_TREE && plan.strategy != PATCH_STRATEGY_FULL) {
+            uint8_t hash[CRS_STRONG_DIGEST_SIZE];
+            Digest_CalcTree(fd, hash);
+            if(0 != memcmp(hash, fd->fileDigest, CRS_STRONG_DIGEST_SIZE)) {
+                LOGE("block digests not match fileDigest\n");
+                code = CRS_BUG;
+                break;
+            }
+        }
+        if(plan.strategy == PATCH_STRATEGY_FULL) {
+            code = Patch_full(dstFilename, url, coarse, name);
+            if(code == CRS_OK) {
+                crs_callback_patch(name, fd->fileSize, 0, 1);
+            }
+            break;
+        }
+        if(local.matchNum > 0 && 0 != access(srcFilename, F_OK)) {
             LOGE("src file not exist %s\n", strerror(errno));
             LOGE("%s\n", srcFilename);
             code = CRS_FILE_ERROR;
@@ -279,28 +1177,376 @@ CRScode Patch_perform(const char *srcFilename, const char *dstFilename, const ch
             }
         }
 #endif
+        fileWriter_t *dst = Util_writerOpen(dstFilename, fd->fileSize);
+        if(!dst) {
+            code = CRS_FILE_ERROR;
+            break;
+        }
         //Patch_match Blocks
-        code = Patch_match(srcFilename, dstFilename, fd, dr);
-        if(code != CRS_OK) break;
+        code = Patch_match(srcFilename, dst, fd, &local, coarse, (fd != coarse) ? coarseDr : NULL);
+        if(code == CRS_OK && fd != coarse) {
+            fallback = Patch_refineFallback(coarseDr, &local, coarse->blockSize / fd->blockSize);
+        }
+        if(fallback) {
+            Util_writerClose(dst);
+            break;
+        }
+        if(code == CRS_OK) {
+            code = Patch_constantFill(dst, fd, &local, fill);
+        }
+        if(code == CRS_OK) {
+            code = Patch_borrowCopy(dst, fd, &local, borrow, borrowNum);
+        }
 
         //Patch_miss Blocks
-        code = Patch_miss(srcFilename, dstFilename, url, fd, dr);
+        if(code == CRS_OK) {
+            code = Patch_miss(srcFilename, dst, url, fd, &local);
+        }
+        if(code == CRS_OK) {
+            code = Patch_dedupCopy(dst, dstFilename, fd, &local, rep);
+        }
+        if(0 != Util_writerFlush(dst) && code == CRS_OK) {
+            code = CRS_FILE_ERROR;
+        }
+        Util_writerClose(dst);
         if(code != CRS_OK) break;
 
-        char *tempname = strdup(srcFilename);
-        char *name = basename(tempname);
+        //every block checked against its data: matched by Patch_match, cached by Diff_cache,
+        //constant by Patch_constant, borrowed and duplicated as copied, missing by Range_callback.
+        //tree mode block digests bound to fileDigest above, so that is the whole file's proof;
+        //file mode digests and refined fine ones bound to nothing, the file read again
+        if(fd != coarse || coarse->digestMode == DIGEST_MODE_FILE) {
+            uint8_t hash[CRS_STRONG_DIGEST_SIZE];
+            Digest_CalcFile(dstFilename, coarse, hash);
+            if(0 != memcmp(hash, coarse->fileDigest, CRS_STRONG_DIGEST_SIZE)) {
+                LOGE("patched file not match fileDigest\n");
+                code = CRS_BUG;
+                break;
+            }
+        }
         crs_callback_patch(name, fd->fileSize, 0, 1);
+
+    } while (0);
+
+    free(tempname);
+    free(rep);
+    free(fill);
+    free(fineBorrow);
+    free(local.offsets);
+    if(fallback) {
+        LOGW("local blocks changed under matched ones, patch by coarse blocks\n");
+        code = Patch_performBorrow(srcFilename, dstFilename, url, coarse, fallback, coarseBorrow, coarseBorrowNum);
+        diffResult_free(fallback);
+    }
+    LOGI("end %d\n", code);
+    return code;
+}
+
+enum INPLACEaction {
+    INPLACE_COPY = 0,   //move inside file
+    INPLACE_BUFFER,     //read into memory now, write after all moves
+    INPLACE_DOWNLOAD,   //give up local data, fetch by http
+};
+
+typedef struct runindex_t {
+    size_t src;
+    size_t end;
+    uint32_t idx;
+} runindex_t;
+
+static int runindex_cmp(const void *a, const void *b) {
+    const runindex_t *x = a, *y = b;
+    return (x->src < y->src) ? -1 : (x->src > y->src);
+}
+
+//run A must move before run B if B's dst overwrites A's src.
+//topological order of runs, cycles broken by buffer or download, return buffered Bytes
+static size_t Patch_inplaceOrder(const copyrun_t *runs, uint32_t runNum, size_t bufferLimit,
+                                 uint32_t *order, uint8_t *action) {
+    runindex_t *bySrc = malloc(sizeof(runindex_t) * runNum);
+    size_t maxLen = 0;
+    for(uint32_t i=0; i<runNum; ++i) {
+        bySrc[i].src = runs[i].src;
+        bySrc[i].end = runs[i].src + runs[i].len;
+        bySrc[i].idx = i;
+        if(runs[i].len > maxLen) maxLen = runs[i].len;
+    }
+    qsort(bySrc, runNum, sizeof(runindex_t), runindex_cmp);
+
+    //edges A->B as compressed adjacency: first pass counts, second pass fills
+    uint32_t *edgeStart = calloc(runNum + 1, sizeof(uint32_t));
+    uint32_t *edges = NULL;
+    uint32_t *indeg = calloc(runNum, sizeof(uint32_t));
+    for(int pass=0; pass<2; ++pass) {
+        uint32_t *fill = (pass == 1) ? calloc(runNum, sizeof(uint32_t)) : NULL;
+        for(uint32_t b=0; b<runNum; ++b) {
+            size_t dst = runs[b].dst, dstEnd = runs[b].dst + runs[b].len;
+            //first src >= dstEnd
+            uint32_t lo = 0, hi = runNum;
+            while(lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                if(bySrc[mid].src < dstEnd) lo = mid + 1; else hi = mid;
+            }
+            for(uint32_t j=lo; j>0 && bySrc[j-1].src + maxLen > dst; --j) {
+                const runindex_t *a = &bySrc[j-1];
+                if(a->idx == b || a->end <= dst) continue; //self overlap moves like memmove
+                if(pass == 0) {
+                    edgeStart[a->idx + 1]++;
+                    indeg[b]++;
+                } else {
+                    edges[edgeStart[a->idx] + fill[a->idx]++] = b;
+                }
+            }
+        }
+        if(pass == 0) {
+            for(uint32_t i=0; i<runNum; ++i) {
+                edgeStart[i+1] += edgeStart[i];
+            }
+            edges = malloc(sizeof(uint32_t) * (edgeStart[runNum] + 1));
+        }
+        free(fill);
+    }
+
+    uint8_t *done = calloc(runNum, 1);
+    uint32_t *queue = malloc(sizeof(uint32_t) * runNum);
+    uint32_t head = 0, tail = 0, orderNum = 0;
+    size_t bufferBytes = 0;
+    for(uint32_t i=0; i<runNum; ++i) {
+        if(indeg[i] == 0) queue[tail++] = i;
+    }
+    while(orderNum < runNum) {
+        uint32_t u;
+        if(head < tail) {
+            u = queue[head++];
+            if(done[u]) continue;
+            action[u] = INPLACE_COPY;
+        } else {
+            //cycle: release the smallest run left
+            u = runNum;
+            for(uint32_t i=0; i<runNum; ++i) {
+                if(!done[i] && (u == runNum || runs[i].len < runs[u].len)) u = i;
+            }
+            if(bufferBytes + runs[u].len <= bufferLimit) {
+                action[u] = INPLACE_BUFFER;
+                bufferBytes += runs[u].len;
+            } else {
+                action[u] = INPLACE_DOWNLOAD;
+            }
+        }
+        done[u] = 1;
+        order[orderNum++] = u;
+        for(uint32_t e=edgeStart[u]; e<edgeStart[u+1]; ++e) {
+            uint32_t v = edges[e];
+            if(--indeg[v] == 0 && !done[v]) queue[tail++] = v;
+        }
+    }
+
+    free(queue);
+    free(done);
+    free(indeg);
+    free(edges);
+    free(edgeStart);
+    free(bySrc);
+    return bufferBytes;
+}
+
+//check matched blocks against their strong digest before any move, changed ones go back to missing
+static CRScode Patch_inplaceCheck(const char *filename, const fileDigest_t *fd, diffResult_t *dr) {
+    FILE *f = fopen(filename, "rb");
+    if(!f) {
+        LOGE("file open error %s\n", strerror(errno));
+        return CRS_FILE_ERROR;
+    }
+    uint8_t *buf = malloc(fd->blockSize);
+    uint8_t hash[CRS_STRONG_DIGEST_SIZE];
+    CRScode code = CRS_OK;
+    int32_t failNum = 0;
+    for(int32_t i=0; i<dr->totalNum; ++i) {
+        if(dr->offsets[i] < 0) continue;
+        if(0 != fseek(f, dr->offsets[i], SEEK_SET) || fd->blockSize != fread(buf, 1, fd->blockSize, f)) {
+            code = CRS_FILE_ERROR;
+            break;
+        }
+        Digest_CalcStrong_Data(buf, fd->blockSize, hash);
+        if(0 != memcmp(hash, fd->blockDigest[i].strong, CRS_STRONG_DIGEST_SIZE)) {
+            dr->offsets[i] = -1;
+            failNum++;
+        }
+    }
+    free(buf);
+    fclose(f);
+    if(failNum > 0) {
+        LOGW("matched blocks %d changed in file, download them\n", failNum);
+    }
+    return code;
+}
+
+//move run inside file by chunks, direction keeps self overlap safe
+static CRScode Patch_inplaceMove(fileWriter_t *w, FILE *f, const copyrun_t *r, uint8_t *buf, size_t bufSize) {
+    for(size_t moved=0; moved<r->len && r->src != r->dst; ) {
+        size_t n = (r->len - moved < bufSize) ? r->len - moved : bufSize;
+        size_t k = (r->dst < r->src) ? moved : r->len - moved - n;
+        fseek(f, r->src + k, SEEK_SET);
+        if(n != fread(buf, 1, n, f) || 0 != Util_writerWrite(w, r->dst + k, buf, n)) {
+            return CRS_FILE_ERROR;
+        }
+        moved += n;
+    }
+    return CRS_OK;
+}
+
+CRScode Patch_inplace(const char *filename, const char *url,
+                      const fileDigest_t *fd, const diffResult_t *dr) {
+    LOGI("begin\n");
+
+    if(!filename || !url || !fd || !dr) {
+        LOGE("end %d\n", CRS_PARAM_ERROR);
+        return CRS_PARAM_ERROR;
+    }
+
+    CRScode code = CRS_OK;
+    //local copy, cycles may turn matched blocks into missing ones
+    diffResult_t local;
+    local.totalNum = dr->totalNum;
+    local.matchNum = 0;
+    local.cacheNum = 0;
+    local.fine = NULL; //moves in place by coarse blocks only
+    local.fineDr = NULL;
+    local.offsets = malloc(sizeof(int32_t) * (dr->totalNum > 0 ? dr->totalNum : 1));
+    for(int i=0; i<dr->totalNum; ++i) {
+        local.offsets[i] = (dr->offsets[i] >= 0) ? dr->offsets[i] : -1; //no dst file, no cache
+    }
+    copyrun_t *runs = malloc(sizeof(copyrun_t) * (dr->totalNum > 0 ? dr->totalNum : 1));
+    uint32_t *order = malloc(sizeof(uint32_t) * (dr->totalNum > 0 ? dr->totalNum : 1));
+    uint8_t *action = malloc(dr->totalNum > 0 ? dr->totalNum : 1);
+    size_t *bufferPos = malloc(sizeof(size_t) * (dr->totalNum > 0 ? dr->totalNum : 1));
+    uint8_t *buffer = NULL;
+    fileWriter_t *w = NULL;
+    FILE *f = NULL;
+
+    do {
+        struct stat st;
+        if(stat(filename, &st) != 0) {
+            LOGE("file stat fail %s\n", strerror(errno));
+            LOGE("%s\n", filename);
+            code = CRS_FILE_ERROR;
+            break;
+        }
+        //file content changes from now on, its local digest is stale
+        char *digestFilename = Util_strcat(filename, DIGEST_EXT);
+        remove(digestFilename);
+        free(digestFilename);
+
+        size_t workSize = ((size_t)st.st_size > fd->fileSize) ? (size_t)st.st_size : fd->fileSize;
+#ifndef _MSC_VER
+        if((size_t)st.st_size < workSize && 0 != truncate(filename, workSize)) {
+            LOGE("file truncate %luBytes error %s\n", (unsigned long)workSize, strerror(errno));
+            code = CRS_FILE_ERROR;
+            break;
+        }
+#endif
+        code = Patch_inplaceCheck(filename, fd, &local);
+        if(code != CRS_OK) break;
+        uint32_t runNum = Patch_matchRuns(fd, &local, runs);
+        size_t bufferBytes = Patch_inplaceOrder(runs, runNum, s_option.inplaceBuffer, order, action);
+        LOGI("move runs Num = %d, buffer %luBytes\n", runNum, (unsigned long)bufferBytes);
+
+        w = Util_writerOpen(filename, workSize);
+        f = fopen(filename, "rb");
+        if(!w || !f) {
+            LOGE("file open error %s\n", strerror(errno));
+            code = CRS_FILE_ERROR;
+            break;
+        }
+        setvbuf(f, NULL, _IONBF, 0); //always read what just written
+        buffer = malloc(bufferBytes + fd->blockSize);
+        uint8_t *chunk = buffer + bufferBytes;
+
+        size_t used = 0;
+        for(uint32_t i=0; i<runNum && code == CRS_OK; ++i) {
+            const copyrun_t *r = &runs[order[i]];
+            switch(action[order[i]]) {
+            case INPLACE_COPY:
+                code = Patch_inplaceMove(w, f, r, chunk, fd->blockSize);
+                break;
+            case INPLACE_BUFFER:
+                bufferPos[order[i]] = used;
+                fseek(f, r->src, SEEK_SET);
+                if(r->len != fread(buffer + used, 1, r->len, f)) {
+                    code = CRS_FILE_ERROR;
+                }
+                used += r->len;
+                break;
+            default:
+                for(size_t pos=r->dst; pos<r->dst + r->len; pos+=fd->blockSize) {
+                    local.offsets[pos / fd->blockSize] = -1;
+                }
+                break;
+            }
+        }
+        for(uint32_t i=0; i<runNum && code == CRS_OK; ++i) {
+            if(action[i] == INPLACE_BUFFER &&
+               0 != Util_writerWrite(w, runs[i].dst, buffer + bufferPos[i], runs[i].len)) {
+                code = CRS_FILE_ERROR;
+            }
+        }
+        if(code != CRS_OK) {
+            LOGE("file move error\n");
+            break;
+        }
+
+        size_t restSize = fd->fileSize % fd->blockSize;
+        if(restSize > 0 && 0 != Util_writerWrite(w, fd->fileSize - restSize, fd->restData, restSize)) {
+            code = CRS_FILE_ERROR;
+            break;
+        }
+
+        for(int i=0; i<local.totalNum; ++i) {
+            if(local.offsets[i] >= 0) local.matchNum++;
+        }
+        //after moves, so local data not overwritten before read
+        uint8_t *fill = Patch_constant(fd, &local, 0);
+        int32_t *rep = Patch_dedup(fd, &local);
+        code = Patch_constantFill(w, fd, &local, fill);
+        if(code == CRS_OK) {
+            code = Patch_miss(filename, w, url, fd, &local);
+        }
+        if(code == CRS_OK) {
+            code = Patch_dedupCopy(w, filename, fd, &local, rep);
+        }
+        free(rep);
+        free(fill);
+    } while(0);
+
+    if(f) fclose(f);
+    if(w) {
+        if(0 != Util_writerFlush(w) && code == CRS_OK) {
+            code = CRS_FILE_ERROR;
+        }
+        Util_writerClose(w);
+    }
+#ifndef _MSC_VER
+    if(code == CRS_OK && 0 != truncate(filename, fd->fileSize)) {
+        LOGE("file truncate %dBytes error %s\n", fd->fileSize, strerror(errno));
+        code = CRS_FILE_ERROR;
+    }
+#endif
+    if(code == CRS_OK) {
+        char *tempname = strdup(filename);
+        crs_callback_patch(basename(tempname), fd->fileSize, 0, 1);
         free(tempname);
 
         uint8_t hash[CRS_STRONG_DIGEST_SIZE];
-        Digest_CalcStrong_File(dstFilename, hash);
-        char * hashString = Util_hex_string(hash, CRS_STRONG_DIGEST_SIZE);
-        LOGI("fileDigest = %s\n", hashString);
-        free(hashString);
+        Digest_CalcFile(filename, fd, hash);
         code = (0 == memcmp(hash, fd->fileDigest, CRS_STRONG_DIGEST_SIZE)) ? CRS_OK : CRS_BUG ;
+    }
 
-    } while (0);
-
+    free(buffer);
+    free(bufferPos);
+    free(action);
+    free(order);
+    free(runs);
+    free(local.offsets);
     LOGI("end %d\n", code);
     return code;
 }
@@ -30,9 +30,75 @@ extern "C" {
 
 #include "diff.h"
 
+//cost model of missing blocks' http range requests
+typedef struct patchOption_t {
+    uint32_t rtt;           //request round trip time, ms
+    uint32_t bandwidth;     //download speed, Bytes per second
+    uint32_t headerBytes;   //request and response header size, Bytes
+    uint32_t maxRangeBytes; //max length of one combined range, 0 means unlimited
+    uint32_t rangesPerRequest; //max ranges of one multi-range request, 1 means single range
+    uint32_t connections; //max concurrent range requests
+    uint32_t inplace; //1 helper patches src file in place, no dst file
+    uint32_t inplaceBuffer; //memory to break in place move cycles, Bytes
+    uint32_t sparse; //1 punch holes for zero blocks instead of writing them
+    uint32_t copySpeed; //local src to dst copy speed, Bytes per second
+    uint32_t planner; //1 download whole file when cheaper than delta, 0 always delta
+    uint32_t adaptive; //1 tune connections and ranges by measured throughput, options above as max
+} patchOption_t;
+
+void Patch_getOption(patchOption_t *opt);
+void Patch_setOption(const patchOption_t *opt);
+
+//current transfer parameters, AIMD tuned by range requests and kept between patches
+typedef struct patchTuner_t {
+    uint32_t connections; //concurrent range requests
+    uint32_t rangesPerRequest;
+    uint32_t maxRangeBytes; //one range length, 0 means unlimited
+    uint32_t throughput; //all connections' download speed, Bytes per second
+    uint32_t rtt; //ms, from HTTP_getLink
+} patchTuner_t;
+
+void Patch_getTuner(patchTuner_t *tuner);
+
+typedef enum {
+    PATCH_STRATEGY_DELTA = 0, //local copy and http ranges
+    PATCH_STRATEGY_FULL, //one streaming download of whole file
+} PATCHstrategy;
+
+//estimated update cost, rtt and bandwidth measured by HTTP_getLink if any, else patchOption_t
+typedef struct patchPlan_t {
+    PATCHstrategy strategy;
+    uint32_t rtt; //ms, used by estimation
+    uint32_t bandwidth; //Bytes per second, used by estimation
+    uint32_t requests; //delta range requests
+    size_t   deltaBytes; //delta download bytes, headers included
+    size_t   copyBytes; //delta local copy bytes
+    uint32_t deltaCost; //ms
+    uint32_t fullCost; //ms
+} patchPlan_t;
+
+//plan how Patch_perform updates dst, dr as Diff_perform result
+void Patch_plan(const fileDigest_t *fd, const diffResult_t *dr, patchPlan_t *plan);
+
 CRScode Patch_perform(const char *srcFilename, const char *dstFilename, const char *url,
                       const fileDigest_t *fd, const diffResult_t *dr);
 
+//missing block found in another local file, copied instead of download if its digest checks
+typedef struct patchBorrow_t {
+    const char *filename;
+    size_t offset; //block offset in filename
+    int32_t seq; //block index in dst
+} patchBorrow_t;
+
+//Patch_perform, borrow blocks copied first, the ones fail checking downloaded as usual
+CRScode Patch_performBorrow(const char *srcFilename, const char *dstFilename, const char *url,
+                            const fileDigest_t *fd, const diffResult_t *dr,
+                            const patchBorrow_t *borrow, uint32_t borrowNum);
+
+//patch filename itself to target, dr must be diffed against filename without dst cache
+CRScode Patch_inplace(const char *filename, const char *url,
+                      const fileDigest_t *fd, const diffResult_t *dr);
+
 #if defined __cplusplus
 }
 #endif
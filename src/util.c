@@ -26,6 +26,20 @@ SOFTWARE.
 #include <string.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <fcntl.h>
+
+#ifdef _MSC_VER
+#   include <windows.h>
+#else
+#   include <sys/mman.h>
+#endif
+
+#ifdef __linux__
+#   include <sys/ioctl.h>
+#   include <sys/syscall.h>
+#   include <linux/fs.h>
+#   include <linux/falloc.h>
+#endif
 
 #include "unistd-cross.h"
 #include "util.h"
@@ -151,3 +165,236 @@ int Util_filemove(const char *src, const char *dst) {
         return -1;
     }
 }
+
+void Util_msleep(uint32_t ms) {
+#ifdef _MSC_VER
+    Sleep(ms);
+#else
+    usleep(ms * 1000);
+#endif
+}
+
+fileWriter_t* Util_writerOpen(const char *filename, size_t size) {
+    fileWriter_t *w = calloc(1, sizeof(fileWriter_t));
+    w->size = size;
+    w->fd = -1;
+#ifdef _MSC_VER
+    w->file = fopen(filename, "rb+");
+    if(!w->file) {
+        LOGE("%s fopen %s\n", filename, strerror(errno));
+        free(w);
+        return NULL;
+    }
+#else
+    w->fd = open(filename, O_RDWR);
+    if(w->fd < 0) {
+        LOGE("%s open %s\n", filename, strerror(errno));
+        free(w);
+        return NULL;
+    }
+    if(size > 0) {
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0);
+        if(p != MAP_FAILED) {
+            w->data = p;
+        } else {
+            LOGW("mmap %s, fallback to pwrite\n", strerror(errno));
+        }
+    }
+#endif
+    return w;
+}
+
+uint8_t* Util_writerPtr(fileWriter_t *w, size_t offset, size_t len) {
+    if(!w->data || offset + len > w->size) return NULL;
+    return w->data + offset;
+}
+
+int Util_writerWrite(fileWriter_t *w, size_t offset, const void *data, size_t len) {
+    if(offset + len > w->size) {
+        LOGE("write %lu-%lu out of file\n", (unsigned long)offset, (unsigned long)(offset + len));
+        return -1;
+    }
+    if(w->data) {
+        memcpy(w->data + offset, data, len);
+        return 0;
+    }
+#ifdef _MSC_VER
+    fseek(w->file, offset, SEEK_SET);
+    return (fwrite(data, 1, len, w->file) == len) ? 0 : -1;
+#else
+    const uint8_t *p = data;
+    while(len > 0) {
+        ssize_t n = pwrite(w->fd, p, len, offset);
+        if(n <= 0) {
+            if(n < 0 && errno == EINTR) continue;
+            LOGE("pwrite %s\n", strerror(errno));
+            return -1;
+        }
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+#endif
+}
+
+#ifdef __linux__
+//0 done, -1 not supported here, caller copies by itself
+static int Util_kernelCopy(int dstfd, size_t offset, int srcfd, size_t srcOffset, size_t len) {
+#ifdef FICLONERANGE
+    static const size_t align = 4096; //clone only whole fs blocks
+    if(offset % align == 0 && srcOffset % align == 0 && len % align == 0) {
+        struct file_clone_range fcr;
+        fcr.src_fd = srcfd;
+        fcr.src_offset = srcOffset;
+        fcr.src_length = len;
+        fcr.dest_offset = offset;
+        if(0 == ioctl(dstfd, FICLONERANGE, &fcr)) {
+            return 0;
+        }
+    }
+#endif
+#ifdef __NR_copy_file_range
+    while(len > 0) {
+        loff_t in = srcOffset, out = offset;
+        long n = syscall(__NR_copy_file_range, srcfd, &in, dstfd, &out, len, 0);
+        if(n <= 0) {
+            if(n < 0 && errno == EINTR) continue;
+            return -1; //ENOSYS, EXDEV etc., rest copied by caller
+        }
+        srcOffset += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+#endif
+
+int Util_writerCopy(fileWriter_t *w, size_t offset, FILE *src, size_t srcOffset, size_t len) {
+    if(offset + len > w->size) {
+        LOGE("copy %lu-%lu out of file\n", (unsigned long)offset, (unsigned long)(offset + len));
+        return -1;
+    }
+#ifdef __linux__
+    if(0 == Util_kernelCopy(w->fd, offset, fileno(src), srcOffset, len)) {
+        return 0;
+    }
+#endif
+    if(0 != fseek(src, srcOffset, SEEK_SET)) {
+        return -1;
+    }
+    uint8_t *p = Util_writerPtr(w, offset, len);
+    if(p) {
+        return (fread(p, 1, len, src) == len) ? 0 : -1;
+    }
+    static const size_t bufSize = 1024*1024;
+    uint8_t *buf = malloc(bufSize);
+    int ret = 0;
+    while(len > 0 && ret == 0) {
+        size_t n = (len < bufSize) ? len : bufSize;
+        if(fread(buf, 1, n, src) != n || 0 != Util_writerWrite(w, offset, buf, n)) {
+            ret = -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    free(buf);
+    return ret;
+}
+
+int Util_writerFill(fileWriter_t *w, size_t offset, uint8_t value, size_t len, int punch) {
+    if(offset + len > w->size) {
+        LOGE("fill %lu-%lu out of file\n", (unsigned long)offset, (unsigned long)(offset + len));
+        return -1;
+    }
+#if defined(__linux__) && defined(__NR_fallocate) && defined(FALLOC_FL_PUNCH_HOLE)
+    if(punch && value == 0 && w->fd >= 0 &&
+       0 == syscall(__NR_fallocate, w->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)len)) {
+        return 0;
+    }
+#endif
+    uint8_t *p = Util_writerPtr(w, offset, len);
+    if(p) {
+        memset(p, value, len);
+        return 0;
+    }
+    uint8_t *buf = malloc(len);
+    memset(buf, value, len);
+    int ret = Util_writerWrite(w, offset, buf, len);
+    free(buf);
+    return ret;
+}
+
+int Util_writerFlush(fileWriter_t *w) {
+#ifdef _MSC_VER
+    return fflush(w->file);
+#else
+    if(w->data && 0 != msync(w->data, w->size, MS_SYNC)) {
+        LOGE("msync %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+void Util_writerClose(fileWriter_t *w) {
+    if(!w) return;
+#ifdef _MSC_VER
+    fclose(w->file);
+#else
+    if(w->data) {
+        munmap(w->data, w->size);
+    }
+    close(w->fd);
+#endif
+    free(w);
+}
+
+fileMap_t* Util_mapOpen(const char *filename) {
+    struct stat st;
+    if(stat(filename, &st) != 0 || st.st_size == 0) {
+        return NULL;
+    }
+    fileMap_t *m = calloc(1, sizeof(fileMap_t));
+    m->size = st.st_size;
+#ifndef _MSC_VER
+    int fd = open(filename, O_RDONLY);
+    if(fd >= 0) {
+        void *p = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(p != MAP_FAILED) {
+            m->data = p;
+            m->mapped = 1;
+            return m;
+        }
+        LOGW("mmap %s, fallback to read\n", strerror(errno));
+    }
+#endif
+    FILE *f = fopen(filename, "rb");
+    uint8_t *buf = malloc(m->size);
+    if(!f || m->size != fread(buf, 1, m->size, f)) {
+        LOGE("%s read %s\n", filename, strerror(errno));
+        if(f) fclose(f);
+        free(buf);
+        free(m);
+        return NULL;
+    }
+    fclose(f);
+    m->data = buf;
+    return m;
+}
+
+void Util_mapClose(fileMap_t *m) {
+    if(!m) return;
+#ifndef _MSC_VER
+    if(m->mapped) {
+        munmap((void*)m->data, m->size);
+        m->data = NULL;
+    }
+#endif
+    free((void*)m->data);
+    free(m);
+}
@@ -28,6 +28,9 @@ SOFTWARE.
 extern "C" {
 #endif
 
+#include <stdio.h>
+#include <stdint.h>
+
 char* Util_hex_string(const unsigned char *in, const unsigned int inlen);
 
 unsigned char* Util_string_hex(const char *in);
@@ -40,6 +43,44 @@ int Util_filecpy(const char *src, const char *dst);
 
 int Util_filemove(const char *src, const char *dst);
 
+void Util_msleep(uint32_t ms);
+
+//random access writer of a pre-sized file, mmap or pwrite, no stdio buffer
+typedef struct fileWriter_t {
+    uint8_t *data; //whole file mapped, NULL if mmap unavailable
+    size_t  size;
+    int     fd;
+    FILE    *file; //only used where no pwrite
+} fileWriter_t;
+
+fileWriter_t* Util_writerOpen(const char *filename, size_t size);
+
+//pointer to [offset, offset+len) in mapped file, NULL if not mapped
+uint8_t* Util_writerPtr(fileWriter_t *w, size_t offset, size_t len);
+
+int   Util_writerWrite(fileWriter_t *w, size_t offset, const void *data, size_t len);
+
+//copy src[srcOffset, srcOffset+len) to offset, reflink or in-kernel copy if possible
+int   Util_writerCopy(fileWriter_t *w, size_t offset, FILE *src, size_t srcOffset, size_t len);
+
+//fill [offset, offset+len) with value, zero may punch a hole if punch is 1
+int   Util_writerFill(fileWriter_t *w, size_t offset, uint8_t value, size_t len, int punch);
+
+int   Util_writerFlush(fileWriter_t *w);
+
+void  Util_writerClose(fileWriter_t *w);
+
+//whole file read only, mmap or read into memory
+typedef struct fileMap_t {
+    const uint8_t *data;
+    size_t  size;
+    int     mapped; //1 mmap, 0 malloc
+} fileMap_t;
+
+fileMap_t* Util_mapOpen(const char *filename);
+
+void  Util_mapClose(fileMap_t *m);
+
 #if defined __cplusplus
 }
 #endif